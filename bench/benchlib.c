@@ -0,0 +1,678 @@
+// Host-native microbenchmarks for the lib/ string and printf routines.
+//
+// 'make bench-lib' compiles lib/string.c and lib/printfmt.c for the host
+// with the same -O1 -fno-builtin flags the kernel uses, renames their
+// symbols with a jos_ prefix so they do not collide with the host C
+// library, and links them against this harness.  Each case is timed
+// with clock_gettime and reported as ns per call and GB/s of data
+// touched; the results are also written as JSON, one case per line,
+// so that runs from different commits can be compared with -b.
+//
+// Usage: bench-lib [-o out.json] [-b baseline.json] [-r rev] [filter]
+//        bench-lib -c
+//
+// Only cases whose key contains 'filter' are run.  With -c ('make
+// check-lib'), nothing is timed: instead every variant of the copy and
+// scan routines is checked against the host C library, and the exit
+// status says whether they all agreed.
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// The routines under test, renamed by objcopy.
+int jos_strlen(const char *s);
+int jos_strcmp(const char *p, const char *q);
+char *jos_strchr(const char *s, char c);
+void *jos_memset(void *dst, int c, size_t len);
+void *jos_memcpy(void *dst, const void *src, size_t len);
+void *jos_memmove(void *dst, const void *src, size_t len);
+void *jos_memfind(const void *s, int c, size_t len);
+void jos_string_set_variant(int variant);
+void jos_string_set_scan(int scan);
+int jos_snprintf(char *buf, int n, const char *fmt, ...);
+
+// Mirrors of the constants in inc/string.h
+static const char *const copy_variants[] = { "rep", "erms", "sse2", "fsrm" };
+static const char *const scan_variants[] = { "swar", "sse2" };
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof(a[0]))
+
+#define MAXSIZE		(1 << 20)
+#define SLACK		64		// room for misalignment
+#define MINTIME		10000000	// ns per timed run
+#define NRUNS		3		// keep the best of this many runs
+
+static char *buf1, *buf2;
+
+// One benchmark case: 'op' performs 'iters' calls and returns how many
+// bytes each call touched, for the GB/s figure.
+struct Case {
+	const char *op;
+	const char *impl;
+	size_t size;
+	int dalign, salign;
+	const char *fmt;		// for snprintf cases
+	int args;			// which arguments 'fmt' takes
+};
+
+// Argument lists for the snprintf cases
+enum { ARGS_INT, ARGS_LL, ARGS_STR, ARGS_LINE };
+
+static FILE *out;
+static const char *filter;
+static int first = 1;
+
+// Baseline results, read from an earlier JSON file.
+struct Base {
+	char key[128];
+	double ns;
+};
+static struct Base *base;
+static int nbase;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t
+run(const struct Case *c, long iters)
+{
+	char *d = buf1 + c->dalign, *s = buf2 + c->salign;
+	size_t n = c->size, bytes = n;
+	long i;
+
+	if (strcmp(c->op, "memcpy") == 0) {
+		for (i = 0; i < iters; i++)
+			jos_memcpy(d, s, n);
+		bytes = 2 * n;
+	} else if (strcmp(c->op, "memmove") == 0) {
+		// overlapping, so that the copy runs backward
+		for (i = 0; i < iters; i++)
+			jos_memmove(s + 8, s, n);
+		bytes = 2 * n;
+	} else if (strcmp(c->op, "memset") == 0) {
+		for (i = 0; i < iters; i++)
+			jos_memset(d, i, n);
+	} else if (strcmp(c->op, "strlen") == 0) {
+		for (i = 0; i < iters; i++)
+			jos_strlen(s);
+	} else if (strcmp(c->op, "strchr") == 0) {
+		for (i = 0; i < iters; i++)
+			jos_strchr(s, '#');
+	} else if (strcmp(c->op, "memfind") == 0) {
+		for (i = 0; i < iters; i++)
+			jos_memfind(s, '#', n);
+	} else if (strcmp(c->op, "strcmp") == 0) {
+		for (i = 0; i < iters; i++)
+			jos_strcmp(d, s);
+		bytes = 2 * n;
+	} else if (strcmp(c->op, "snprintf") == 0) {
+		for (i = 0; i < iters; i++)
+			switch (c->args) {
+			case ARGS_INT:
+				bytes = jos_snprintf(d, 256, c->fmt, -123456789);
+				break;
+			case ARGS_LL:
+				bytes = jos_snprintf(d, 256, c->fmt, 12345678901234567ULL);
+				break;
+			case ARGS_STR:
+				bytes = jos_snprintf(d, 256, c->fmt, "readline");
+				break;
+			case ARGS_LINE:
+				bytes = jos_snprintf(d, 256, c->fmt, "kern/monitor.c",
+						     136, "mon_backtrace", 0xf0100a5cU);
+				break;
+			}
+	}
+	return bytes;
+}
+
+// Fill the source buffer for 'c': a string of c->size - 1 non-nul
+// bytes that does not contain '#', and for strcmp an equal copy in
+// the destination buffer.
+static void
+prepare(const struct Case *c)
+{
+	size_t i;
+
+	for (i = 0; i < MAXSIZE + SLACK; i++)
+		buf2[i] = 'a' + i % 26;
+	if (c->size > 0)
+		buf2[c->salign + c->size - 1] = '\0';
+	if (strcmp(c->op, "strcmp") == 0)
+		memcpy(buf1 + c->dalign, buf2 + c->salign, c->size);
+}
+
+static void
+measure(const struct Case *c)
+{
+	char key[128], align[16], delta[32];
+	double t, best, ns;
+	long iters;
+	size_t bytes;
+	int i, r;
+
+	if (c->fmt)
+		snprintf(align, sizeof(align), "-");
+	else
+		snprintf(align, sizeof(align), "%d/%d", c->dalign, c->salign);
+	snprintf(key, sizeof(key), "%s %s %zu %s", c->op, c->impl,
+		 c->size, align);
+	if (filter && !strstr(key, filter))
+		return;
+
+	prepare(c);
+	if (strcmp(c->op, "memcpy") == 0 || strcmp(c->op, "memset") == 0
+	    || strcmp(c->op, "memmove") == 0) {
+		for (i = 0; i < ARRAY_SIZE(copy_variants); i++)
+			if (strcmp(c->impl, copy_variants[i]) == 0)
+				jos_string_set_variant(i);
+	} else
+		jos_string_set_scan(strcmp(c->impl, "sse2") == 0);
+
+	// Find an iteration count that runs for at least MINTIME.
+	for (iters = 1; ; iters *= 2) {
+		t = now();
+		run(c, iters);
+		if (now() - t >= MINTIME / 4)
+			break;
+	}
+	iters = iters * 4;
+	best = 1e30;
+	for (r = 0; r < NRUNS; r++) {
+		t = now();
+		bytes = run(c, iters);
+		t = now() - t;
+		if (t < best)
+			best = t;
+	}
+	ns = best / iters;
+
+	delta[0] = '\0';
+	for (i = 0; i < nbase; i++)
+		if (strcmp(base[i].key, key) == 0) {
+			snprintf(delta, sizeof(delta), " %+6.1f%%",
+				 (ns - base[i].ns) / base[i].ns * 100);
+			break;
+		}
+
+	if (c->fmt)
+		printf("%-9s %-24s %10.2f ns/op %8.3f GB/s%s\n",
+		       c->op, c->impl, ns, bytes / ns, delta);
+	else
+		printf("%-9s %-5s %8zu %5s %10.2f ns/op %8.3f GB/s%s\n",
+		       c->op, c->impl, c->size, align, ns, bytes / ns, delta);
+	fflush(stdout);
+
+	if (out) {
+		fprintf(out, "%s\n {\"key\": \"%s\", \"op\": \"%s\", "
+			"\"impl\": \"%s\", \"size\": %zu, \"align\": \"%s\", "
+			"\"ns\": %.3f, \"gbps\": %.4f}",
+			first ? "" : ",", key, c->op, c->impl, c->size,
+			align, ns, bytes / ns);
+		first = 0;
+	}
+}
+
+// Correctness checks.  Each routine runs on every length up to
+// CHECK_MAXLEN and on the longer check_lens[], at every source and
+// destination offset modulo CHECK_ALIGNS (every fifth for the longer
+// lengths), and its effect on the destination and the guard bytes
+// around it is compared with the host C library's.  Each also runs on
+// buffers that end at the last byte before an inaccessible page, so
+// that a scan or copy that reads past its end faults.
+
+#define CHECK_MAXLEN	200
+#define CHECK_ALIGNS	16
+#define CHECK_PAD	32		// guard bytes on each side
+#define CHECK_AREA	(2 * 66000 + CHECK_ALIGNS + 2 * CHECK_PAD)
+#define CHECK_MAXFAIL	20		// failures reported in detail
+
+static const size_t check_lens[] = {
+	255, 256, 257, 1023, 1024, 1025, 4095, 4096, 4097,
+	65535, 65536, 66000
+};
+
+#define CHECK_NLENS	(CHECK_MAXLEN + 1 + (int) ARRAY_SIZE(check_lens))
+
+static char *chk_src, *chk_dst, *chk_ref;
+static char *gsrc_end, *gdst_end;	// each just below a PROT_NONE page
+static const char *chk_op, *chk_impl;
+static long nchecked, nfailed;
+static uint32_t seed = 1;
+
+// The i'th length to check, and the step between offsets for it
+static size_t
+check_len(int i)
+{
+	return i <= CHECK_MAXLEN ? i : check_lens[i - CHECK_MAXLEN - 1];
+}
+
+static int
+check_step(size_t n)
+{
+	return n <= CHECK_MAXLEN ? 1 : 5;
+}
+
+static void
+check(int ok, size_t n, int da, int sa, const char *what)
+{
+	nchecked++;
+	if (ok)
+		return;
+	if (nfailed++ < CHECK_MAXFAIL)
+		printf("FAIL %s %s len %zu align %d/%d: %s\n",
+		       chk_op, chk_impl, n, da, sa, what);
+}
+
+// A random byte other than 0 and 'avoid'
+static int
+random_byte(int avoid)
+{
+	int c;
+
+	do {
+		seed = seed * 1103515245 + 12345;
+		c = 1 + (seed >> 16) % 255;
+	} while (c == (unsigned char) avoid);
+	return c;
+}
+
+static void
+fill_random(char *p, size_t n, int avoid)
+{
+	while (n-- > 0)
+		*p++ = random_byte(avoid);
+}
+
+// Map 'size' accessible bytes followed by an inaccessible page, and
+// return the address of that page.
+static char *
+map_guarded(size_t size)
+{
+	size_t len = (size + 4095) & ~(size_t) 4095;
+	char *p;
+
+	p = mmap(NULL, len + 4096, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED || mprotect(p + len, 4096, PROT_NONE) < 0) {
+		perror("mmap");
+		exit(1);
+	}
+	return p + len;
+}
+
+// Check memmove from offset 'soff' to offset 'doff' in 'w' random
+// bytes at chk_dst, against the same move in a copy at chk_ref.
+static void
+check_move(size_t n, size_t doff, size_t soff, size_t w, int da, int sa,
+	   const char *what)
+{
+	char *d = chk_dst + doff;
+
+	fill_random(chk_dst, w, -1);
+	memcpy(chk_ref, chk_dst, w);
+
+	check(jos_memmove(d, chk_dst + soff, n) == d, n, da, sa, "return value");
+	memmove(chk_ref + doff, chk_ref + soff, n);
+	check(memcmp(chk_dst, chk_ref, w) == 0, n, da, sa, what);
+}
+
+// memcpy, memmove and memset with the current copy variant
+static void
+check_copy(void)
+{
+	char *d, *s;
+	size_t n, w, half, doff, soff;
+	int li, da, sa, c;
+
+	for (li = 0; li < CHECK_NLENS; li++) {
+		n = check_len(li);
+		half = n / 2;
+		w = 2 * CHECK_PAD + CHECK_ALIGNS + n + half;
+		for (da = 0; da < CHECK_ALIGNS; da += check_step(n))
+			for (sa = 0; sa < CHECK_ALIGNS; sa += check_step(n)) {
+				fill_random(chk_src, w, -1);
+				fill_random(chk_dst, w, -1);
+				memcpy(chk_ref, chk_dst, w);
+				doff = CHECK_PAD + da;
+				soff = CHECK_PAD + sa;
+				d = chk_dst + doff;
+				s = chk_src + soff;
+
+				chk_op = "memcpy";
+				check(jos_memcpy(d, s, n) == d, n, da, sa, "return value");
+				memcpy(chk_ref + doff, s, n);
+				check(memcmp(chk_dst, chk_ref, w) == 0, n, da, sa,
+				      "wrong bytes");
+
+				chk_op = "memset";
+				c = random_byte(-1) | (random_byte(-1) << 8);
+				check(jos_memset(d, c, n) == d, n, da, sa, "return value");
+				memset(chk_ref + doff, c, n);
+				check(memcmp(chk_dst, chk_ref, w) == 0, n, da, sa,
+				      "wrong bytes");
+
+				// Overlapping by less than the alignment, and by
+				// half the length, both ways
+				chk_op = "memmove";
+				check_move(n, doff, soff, w, da, sa, "wrong bytes (overlap)");
+				check_move(n, doff + half, soff, w, da, sa,
+					   "wrong bytes (backward overlap)");
+				check_move(n, doff, soff + half, w, da, sa,
+					   "wrong bytes (forward overlap)");
+			}
+
+		// Source and destination both end at a page end.
+		chk_op = "memcpy";
+		fill_random(gsrc_end - n, n, -1);
+		jos_memcpy(gdst_end - n, gsrc_end - n, n);
+		check(memcmp(gdst_end - n, gsrc_end - n, n) == 0, n, 0, 0,
+		      "wrong bytes at page end");
+		chk_op = "memset";
+		jos_memset(gdst_end - n, 0, n);
+		check(n == 0 || (gdst_end[-1] == 0 && gdst_end[-n] == 0), n, 0, 0,
+		      "wrong bytes at page end");
+	}
+}
+
+// Check the scans on 'n' random bytes at 's' containing 'c' at 'k', or
+// nowhere if k >= n.  At a page end the string's nul is the last
+// accessible byte; elsewhere garbage that includes 'c' follows it.
+static void
+check_scan_one(char *s, size_t n, size_t k, int c, int sa, int end)
+{
+	char *want;
+
+	fill_random(s, n, c);
+	if (!end)
+		fill_random(s + n + 2, CHECK_PAD, -1);
+	if (k < n)
+		s[k] = c;
+
+	chk_op = "memfind";
+	// Just past the end, where it must not be found
+	if (end)
+		s[n] = c;
+	else {
+		s[n] = random_byte(c);
+		s[n + 1] = c;
+	}
+	want = memchr(s, c, n);
+	check(jos_memfind(s, c, n) == (want ? want : s + n), n, 0, sa,
+	      end ? "wrong match at page end" : "wrong match");
+
+	s[n] = '\0';
+	if (c == 0 && k < n)
+		s[k] = 1;
+	chk_op = "strlen";
+	check(jos_strlen(s) == n, n, 0, sa,
+	      end ? "wrong length at page end" : "wrong length");
+	chk_op = "strchr";
+	// Unlike the C library's, JOS's strchr does not find the nul.
+	want = c == 0 ? NULL : strchr(s, c);
+	check(jos_strchr(s, c) == want, n, 0, sa,
+	      end ? "wrong match at page end" : "wrong match");
+}
+
+// strlen, strchr and memfind with the current scan variant
+static void
+check_scan(void)
+{
+	static const int targets[] = { '#', 0xE9, 0 };
+	size_t n, k[4];
+	int li, sa, t, i;
+
+	for (li = 0; li < CHECK_NLENS; li++) {
+		n = check_len(li);
+		// 'c' at the start, middle or end, or nowhere
+		k[0] = 0, k[1] = n / 2, k[2] = n - 1, k[3] = n;
+		for (t = 0; t < ARRAY_SIZE(targets); t++)
+			for (i = 0; i < 4; i++) {
+				for (sa = 0; sa < CHECK_ALIGNS; sa += check_step(n))
+					check_scan_one(chk_src + CHECK_PAD + sa, n,
+						       k[i], targets[t], sa, 0);
+				check_scan_one(gsrc_end - n - 1, n, k[i],
+					       targets[t], 0, 1);
+			}
+	}
+}
+
+static int
+sign(int x)
+{
+	return (x > 0) - (x < 0);
+}
+
+// Compare 'p' with a copy of it at 'q' that differs at 'k' (none if
+// k > n, and if k == n, q stops one byte early), both ways round.
+static void
+check_strcmp_one(char *p, char *q, size_t n, size_t k, int pa, int qa)
+{
+	int want;
+
+	fill_random(p, n, -1);
+	p[n] = '\0';
+	memcpy(q, p, n + 1);
+	if (k < n) {
+		// A differing byte, high bit and all
+		while (q[k] == p[k])
+			q[k] = random_byte(0);
+	} else if (k == n && n > 0)
+		q[n - 1] = '\0';
+	want = sign(strcmp(p, q));
+	check(sign(jos_strcmp(p, q)) == want, n, pa, qa, "wrong sign");
+	check(sign(jos_strcmp(q, p)) == -want, n, qa, pa, "wrong sign (swapped)");
+}
+
+// strcmp, which has one implementation.  At page ends, q ends at the
+// boundary while p is misaligned from it, so that words of q that
+// line up with p's aligned words straddle the boundary.
+static void
+check_strcmp(void)
+{
+	size_t n, k[5];
+	int li, pa, qa, i;
+
+	chk_op = "strcmp";
+	chk_impl = "-";
+	for (li = 0; li < CHECK_NLENS; li++) {
+		n = check_len(li);
+		k[0] = 0, k[1] = n / 2, k[2] = n - 1, k[3] = n, k[4] = n + 1;
+		for (i = 0; i < 5; i++)
+			for (pa = 0; pa < CHECK_ALIGNS; pa += check_step(n)) {
+				for (qa = 0; qa < CHECK_ALIGNS; qa += check_step(n))
+					check_strcmp_one(chk_src + CHECK_PAD + pa,
+							 chk_dst + CHECK_PAD + qa,
+							 n, k[i], pa, qa);
+				check_strcmp_one(gsrc_end - n - 1 - pa,
+						 gdst_end - n - 1, n, k[i], pa, 0);
+			}
+	}
+}
+
+// A read past the end of a buffer at a page end lands here.
+static void
+check_fault(int sig)
+{
+	printf("FAIL %s %s: fault, read past the end of the buffer\n",
+	       chk_op, chk_impl);
+	fflush(stdout);
+	_exit(1);
+}
+
+static int
+check_all(void)
+{
+	int v;
+
+	signal(SIGSEGV, check_fault);
+	signal(SIGBUS, check_fault);
+
+	chk_src = malloc(CHECK_AREA);
+	chk_dst = malloc(CHECK_AREA);
+	chk_ref = malloc(CHECK_AREA);
+	if (!chk_src || !chk_dst || !chk_ref) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	gsrc_end = map_guarded(CHECK_AREA);
+	gdst_end = map_guarded(CHECK_AREA);
+
+	for (v = 0; v < ARRAY_SIZE(copy_variants); v++) {
+		jos_string_set_variant(v);
+		chk_impl = copy_variants[v];
+		check_copy();
+	}
+	for (v = 0; v < ARRAY_SIZE(scan_variants); v++) {
+		jos_string_set_scan(v);
+		chk_impl = scan_variants[v];
+		check_scan();
+	}
+	check_strcmp();
+
+	printf("check: %ld checks, %ld failed\n", nchecked, nfailed);
+	return nfailed != 0;
+}
+
+// Read the "key" and "ns" fields of each line of an earlier run.
+static void
+read_base(const char *path)
+{
+	FILE *f;
+	char line[512], *k, *e;
+
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (!(k = strstr(line, "\"key\": \"")) || !(e = strstr(line, "\"ns\": ")))
+			continue;
+		base = realloc(base, (nbase + 1) * sizeof(*base));
+		k += 8;
+		snprintf(base[nbase].key, sizeof(base[nbase].key), "%.*s",
+			 (int) (strchr(k, '"') - k), k);
+		base[nbase].ns = atof(e + 6);
+		nbase++;
+	}
+	fclose(f);
+}
+
+int
+main(int argc, char **argv)
+{
+	// Destination/source offsets from a 64-byte boundary
+	static const int aligns[][2] = { { 0, 0 }, { 1, 1 }, { 0, 3 }, { 7, 13 } };
+	static const char *const copy_ops[] = { "memcpy", "memmove", "memset" };
+	static const char *const scan_ops[] = { "strlen", "strchr", "memfind", "strcmp" };
+	static const struct {
+		const char *fmt;
+		int args;
+	} fmts[] = {
+		{ "%d", ARGS_INT },
+		{ "%x", ARGS_INT },
+		{ "%08x", ARGS_INT },
+		{ "%20d", ARGS_INT },
+		{ "%-20d|", ARGS_INT },
+		{ "%llu", ARGS_LL },
+		{ "%llx", ARGS_LL },
+		{ "%s", ARGS_STR },
+		{ "%-16s|", ARGS_STR },
+		{ "%.3s", ARGS_STR },
+		{ "%s:%d: %s+%x", ARGS_LINE },
+	};
+	const char *outpath = NULL, *rev = "unknown";
+	struct Case c;
+	size_t size;
+	int ch, i, a, v;
+
+	while ((ch = getopt(argc, argv, "co:b:r:")) != -1)
+		switch (ch) {
+		case 'c':
+			return check_all();
+		case 'o':
+			outpath = optarg;
+			break;
+		case 'b':
+			read_base(optarg);
+			break;
+		case 'r':
+			rev = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o out.json] [-b baseline.json] [-r rev] [filter]\n"
+				"       %s -c\n", argv[0], argv[0]);
+			return 1;
+		}
+	if (optind < argc)
+		filter = argv[optind];
+
+	if (posix_memalign((void **) &buf1, 4096, MAXSIZE + SLACK)
+	    || posix_memalign((void **) &buf2, 4096, MAXSIZE + SLACK)) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	memset(buf1, 0, MAXSIZE + SLACK);
+
+	if (outpath) {
+		if (!(out = fopen(outpath, "w"))) {
+			perror(outpath);
+			return 1;
+		}
+		fprintf(out, "{\"rev\": \"%s\", \"results\": [", rev);
+	}
+
+	memset(&c, 0, sizeof(c));
+	for (i = 0; i < ARRAY_SIZE(copy_ops); i++)
+		for (v = 0; v < ARRAY_SIZE(copy_variants); v++)
+			for (size = 1; size <= MAXSIZE; size *= 4)
+				for (a = 0; a < 4; a++) {
+					c.op = copy_ops[i];
+					c.impl = copy_variants[v];
+					c.size = size;
+					c.dalign = aligns[a][0];
+					c.salign = aligns[a][1];
+					measure(&c);
+				}
+	for (i = 0; i < ARRAY_SIZE(scan_ops); i++)
+		for (v = 0; v < ARRAY_SIZE(scan_variants); v++) {
+			// strcmp has a single implementation
+			if (strcmp(scan_ops[i], "strcmp") == 0 && v > 0)
+				continue;
+			for (size = 1; size <= MAXSIZE; size *= 4)
+				for (a = 0; a < 4; a++) {
+					c.op = scan_ops[i];
+					c.impl = scan_variants[v];
+					c.size = size;
+					c.dalign = aligns[a][0];
+					c.salign = aligns[a][1];
+					measure(&c);
+				}
+		}
+	memset(&c, 0, sizeof(c));
+	for (i = 0; i < ARRAY_SIZE(fmts); i++) {
+		c.op = "snprintf";
+		c.impl = c.fmt = fmts[i].fmt;
+		c.args = fmts[i].args;
+		measure(&c);
+	}
+
+	if (out) {
+		fprintf(out, "\n]}\n");
+		fclose(out);
+		printf("results written to %s\n", outpath);
+	}
+	return 0;
+}
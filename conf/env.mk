@@ -18,3 +18,9 @@ V = @
 # following line and set it to the full path to QEMU.
 #
 # QEMU=
+
+# Uncomment the following line to leave the kernel's debug information
+# out of the loaded kernel image.  The debug index is then compressed,
+# written to the disk image, and read in the first time it is needed.
+#
+# KDBGDISK=1
@@ -11,4 +11,6 @@ typedef __builtin_va_list va_list;
 
 #define va_end(ap) __builtin_va_end(ap)
 
+#define va_copy(dst, src) __builtin_va_copy(dst, src)
+
 #endif	/* !JOS_INC_STDARG_H */
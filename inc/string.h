@@ -22,4 +22,20 @@ void *	memfind(const void *s, int c, size_t len);
 
 long	strtol(const char *s, char **endptr, int base);
 
+// Implementations for large memcpy/memset, chosen at boot
+#define STRING_REP	0	// rep movsl/stosl with aligned head and tail
+#define STRING_ERMS	1	// rep movsb/stosb (Enhanced REP MOVSB/STOSB)
+#define STRING_SSE2	2	// SSE2 loops; requires CR4_OSFXSR
+#define STRING_FSRM	3	// rep movsb at every size (Fast Short REP MOVSB)
+
+void	string_set_variant(int variant);
+const char *string_variant_name(void);
+
+// Implementations for string scanning (strlen, strchr, memfind, ...)
+#define STRSCAN_SWAR	0	// 4 bytes at a time in general registers
+#define STRSCAN_SSE2	1	// pcmpeqb, 16 bytes at a time; requires CR4_OSFXSR
+
+void	string_set_scan(int scan);
+const char *string_scan_name(void);
+
 #endif /* not JOS_INC_STRING_H */
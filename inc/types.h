@@ -23,18 +23,24 @@ typedef unsigned long long uint64_t;
 // We use pointer types to represent virtual addresses,
 // uintptr_t to represent the numerical values of virtual addresses,
 // and physaddr_t to represent physical addresses.
+#ifndef __x86_64__
 typedef int32_t intptr_t;
 typedef uint32_t uintptr_t;
+#else
+// Only when lib/ is compiled for a 64-bit host, as by 'make bench-lib'.
+typedef int64_t intptr_t;
+typedef uint64_t uintptr_t;
+#endif
 typedef uint32_t physaddr_t;
 
 // Page numbers are 32 bits long.
 typedef uint32_t ppn_t;
 
 // size_t is used for memory object sizes.
-typedef uint32_t size_t;
+typedef uintptr_t size_t;
 // ssize_t is a signed version of ssize_t, used in case there might be an
 // error return.
-typedef int32_t ssize_t;
+typedef intptr_t ssize_t;
 
 // off_t is used for file offsets and lengths.
 typedef int32_t off_t;
@@ -227,9 +227,10 @@ static inline void
 cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
 {
 	uint32_t eax, ebx, ecx, edx;
+	// Leaves such as 7 take a subleaf in ecx; always ask for subleaf 0.
 	asm volatile("cpuid"
 		     : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
-		     : "a" (info));
+		     : "a" (info), "c" (0));
 	if (eaxp)
 		*eaxp = eax;
 	if (ebxp)
@@ -248,6 +249,35 @@ read_tsc(void)
 	return tsc;
 }
 
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	asm volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+static inline uint64_t
+rdpmc(uint32_t counter)
+{
+	uint64_t val;
+	asm volatile("rdpmc" : "=A" (val) : "c" (counter));
+	return val;
+}
+
+// Arm address monitoring of the cache line holding 'addr', for mwait.
+static inline void
+monitor_addr(const volatile void *addr)
+{
+	asm volatile("monitor" : : "a" (addr), "c" (0), "d" (0) : "memory");
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
@@ -261,4 +291,29 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically compare *addr with oldval and, if equal, store newval.
+// Return the old contents of *addr.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %0"
+		     : "+m" (*addr), "=a" (result)
+		     : "r" (newval), "1" (oldval)
+		     : "cc", "memory");
+	return result;
+}
+
+// Atomically add v to *addr and return the old contents of *addr.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t v)
+{
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (v), "+m" (*addr)
+		     :
+		     : "cc", "memory");
+	return v;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -0,0 +1,39 @@
+#ifndef JOS_KERN_BENCH_H
+#define JOS_KERN_BENCH_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// In-kernel microbenchmarks, run by the 'bench' monitor command.
+//
+// BENCH(fn, name, batch) defines a function 'fn' that performs the
+// operation being measured 'n' times, and registers it in the .bench
+// section under 'name'.  The harness times 'batch' operations at a
+// time and reports cycles per operation.  Names are "group/variant";
+// 'bench group' runs every benchmark in the group.
+//
+//	BENCH(bench_memset_4k, "memset/4096", 8)
+//	{
+//		while (n-- > 0)
+//			memset(buf, 0, 4096);
+//	}
+
+struct Bench {
+	const char *name;
+	void (*run)(uint32_t n);
+	uint32_t batch;
+};
+
+#define BENCH(fn, name, batch)						\
+	static void fn(uint32_t n);					\
+	static const struct Bench __bench_##fn				\
+		__attribute__((section(".bench"), used, aligned(4)))	\
+		= { name, fn, batch };					\
+	static void fn(uint32_t n)
+
+int bench_run(const char *name);
+void bench_list(void);
+
+#endif	// !JOS_KERN_BENCH_H
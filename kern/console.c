@@ -5,8 +5,13 @@
 #include <inc/kbdreg.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/trap.h>
 
 #include <kern/console.h>
+#include <kern/picirq.h>
+#include <kern/klog.h>
+#include <kern/bench.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -33,6 +38,9 @@ delay(void)
 #define   COM_IER_RDI	0x01	//   Enable receiver data interrupt
 #define COM_IIR		2	// In:	Interrupt ID Register
 #define COM_FCR		2	// Out: FIFO Control Register
+#define   COM_FCR_ENABLE	0x01	//   Enable the transmit/receive FIFOs
+#define   COM_FCR_RCLR	0x02	//   Clear the receive FIFO
+#define   COM_FCR_TCLR	0x04	//   Clear the transmit FIFO
 #define COM_LCR		3	// Out: Line Control Register
 #define	  COM_LCR_DLAB	0x80	//   Divisor latch access bit
 #define	  COM_LCR_WLEN8	0x03	//   Wordlength: 8 bits
@@ -47,6 +55,8 @@ delay(void)
 
 static bool serial_exists;
 
+static void serial_rts_update(void);
+
 static int
 serial_proc_data(void)
 {
@@ -78,8 +88,9 @@ serial_putc(int c)
 static void
 serial_init(void)
 {
-	// Turn off the FIFO
-	outb(COM1+COM_FCR, 0);
+	// Turn on and clear the FIFOs, interrupting on every received byte.
+	// The FIFO holds input that arrives while interrupts are off.
+	outb(COM1+COM_FCR, COM_FCR_ENABLE | COM_FCR_RCLR | COM_FCR_TCLR);
 
 	// Set speed; requires DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_DLAB);
@@ -89,8 +100,9 @@ serial_init(void)
 	// 8 data bits, 1 stop bit, parity off; turn off DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_WLEN8 & ~COM_LCR_DLAB);
 
-	// No modem controls
-	outb(COM1+COM_MCR, 0);
+	// Assert DTR and RTS, and OUT2, which gates the UART's interrupt
+	// line onto the ISA bus on PC hardware
+	outb(COM1+COM_MCR, COM_MCR_DTR | COM_MCR_RTS | COM_MCR_OUT2);
 	// Enable rcv interrupts
 	outb(COM1+COM_IER, COM_IER_RDI);
 
@@ -384,26 +396,87 @@ kbd_init(void)
 
 #define CONSBUFSIZE 512
 
+// Once the buffer is this full, drop RTS so the serial sender pauses;
+// the slack covers the UART FIFO and bytes already on the wire.
+// Raise RTS again once the reader has drained it to CONS_LOWAT.
+#define CONS_HIWAT	(CONSBUFSIZE - 64)
+#define CONS_LOWAT	(CONSBUFSIZE / 4)
+
+// The input buffer is a single-producer/single-consumer ring: only
+// cons_intr (the device interrupt path) advances wpos and only
+// cons_getc advances rpos, so neither side needs a lock.  Both
+// indices run freely and are reduced modulo CONSBUFSIZE on use; a
+// release store of an index publishes the slots behind it, and the
+// other side reads it with an acquire load.
 static struct {
 	uint8_t buf[CONSBUFSIZE];
 	uint32_t rpos;
 	uint32_t wpos;
+	uint32_t dropped;		// bytes lost because the ring was full
+	bool throttled;			// RTS is deasserted
+	volatile uint32_t mcr_lock;	// serializes writes to COM_MCR
 } cons;
 
+// Set once the output devices have been initialized.
+static bool cons_inited;
+
+// Set once the keyboard and serial IRQs are being delivered,
+// after which cons_getc no longer needs to poll the devices.
+static bool cons_irq;
+
+extern const char *panicstr;
+
+static uint32_t
+cons_level(void)
+{
+	return __atomic_load_n(&cons.wpos, __ATOMIC_ACQUIRE)
+		- __atomic_load_n(&cons.rpos, __ATOMIC_ACQUIRE);
+}
+
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
 static void
 cons_intr(int (*proc)(void))
 {
 	int c;
+	uint32_t wpos, rpos;
 
+	wpos = cons.wpos;
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
-		cons.buf[cons.wpos++] = c;
-		if (cons.wpos == CONSBUFSIZE)
-			cons.wpos = 0;
+		rpos = __atomic_load_n(&cons.rpos, __ATOMIC_ACQUIRE);
+		if (wpos - rpos == CONSBUFSIZE) {
+			cons.dropped++;
+			continue;
+		}
+		cons.buf[wpos++ % CONSBUFSIZE] = c;
+		__atomic_store_n(&cons.wpos, wpos, __ATOMIC_RELEASE);
 	}
+
+	if (!cons.throttled && wpos - cons.rpos >= CONS_HIWAT)
+		serial_rts_update();
+}
+
+// Drop or raise RTS to match the input buffer level.
+static void
+serial_rts_update(void)
+{
+	uint32_t level;
+
+	if (!serial_exists)
+		return;
+	while (xchg(&cons.mcr_lock, 1) != 0)
+		asm volatile("pause");
+	level = cons_level();
+	if (!cons.throttled && level >= CONS_HIWAT) {
+		cons.throttled = 1;
+		outb(COM1+COM_MCR, COM_MCR_DTR | COM_MCR_OUT2);
+	} else if (cons.throttled && level <= CONS_LOWAT) {
+		cons.throttled = 0;
+		outb(COM1+COM_MCR, COM_MCR_DTR | COM_MCR_RTS | COM_MCR_OUT2);
+	}
+	xchg(&cons.mcr_lock, 0);
 }
 
 // return the next input character from the console, or 0 if none waiting
@@ -411,21 +484,33 @@ int
 cons_getc(void)
 {
 	int c;
+	uint32_t rpos;
 
 	// poll for any pending input characters,
-	// so that this function works even when interrupts are disabled
-	// (e.g., when called from the kernel monitor).
-	serial_intr();
-	kbd_intr();
+	// so that this function works even when interrupts are not
+	// being delivered (e.g., before cons_irq_init or after a panic).
+	if (!cons_irq || panicstr) {
+		serial_intr();
+		kbd_intr();
+	}
 
 	// grab the next character from the input buffer.
-	if (cons.rpos != cons.wpos) {
-		c = cons.buf[cons.rpos++];
-		if (cons.rpos == CONSBUFSIZE)
-			cons.rpos = 0;
-		return c;
-	}
-	return 0;
+	rpos = cons.rpos;
+	if (rpos == __atomic_load_n(&cons.wpos, __ATOMIC_ACQUIRE))
+		return 0;
+	c = cons.buf[rpos++ % CONSBUFSIZE];
+	__atomic_store_n(&cons.rpos, rpos, __ATOMIC_RELEASE);
+
+	if (__atomic_load_n(&cons.throttled, __ATOMIC_RELAXED))
+		serial_rts_update();
+	return c;
+}
+
+// Return the number of input bytes dropped because the buffer was full.
+uint32_t
+cons_dropped(void)
+{
+	return __atomic_load_n(&cons.dropped, __ATOMIC_RELAXED);
 }
 
 // output a character to the console
@@ -445,16 +530,82 @@ cons_init(void)
 	kbd_init();
 	serial_init();
 
+	cons_inited = 1;
+
 	if (!serial_exists)
 		cprintf("Serial port does not exist!\n");
 }
 
+// Return true once the console can accept output.
+bool
+cons_ready(void)
+{
+	return cons_inited;
+}
+
+// Benchmarks of each console device.  The output alternates between
+// a space and a backspace, so that it leaves nothing behind.
+BENCH(bench_cga, "console/cga", 16)
+{
+	while (n-- > 0)
+		cga_putc(n & 1 ? '\b' : ' ');
+}
+
+BENCH(bench_serial, "console/serial", 16)
+{
+	while (n-- > 0)
+		serial_putc(n & 1 ? '\b' : ' ');
+}
+
+BENCH(bench_lpt, "console/lpt", 16)
+{
+	while (n-- > 0)
+		lpt_putc(n & 1 ? '\b' : ' ');
+}
+
+// cprintf only formats into the kernel log; the log reaches the
+// devices above when it is drained.
+BENCH(bench_cprintf, "console/cprintf", 16)
+{
+	while (n-- > 0)
+		cprintf("%08x\r", n);
+}
+
+// Output 'n' characters to the console devices.
+// Kernel log records reach the console through here.
+void
+cons_write(const char *s, size_t n)
+{
+	while (n-- > 0)
+		cons_putc(*s++);
+}
+
+// Switch console input from polling to the keyboard and serial IRQs.
+// Must be called after the IDT and the interrupt controllers have
+// been set up.
+void
+cons_irq_init(void)
+{
+	// Drain the keyboard and serial receive buffers so that
+	// the devices raise a fresh edge for the next character.
+	kbd_intr();
+	serial_intr();
+
+	irq_enable(IRQ_KBD);
+	if (serial_exists)
+		irq_enable(IRQ_SERIAL);
+	cons_irq = 1;
+}
+
 
 // `High'-level console I/O.  Used by readline and cprintf.
 
 void
 cputchar(int c)
 {
+	// Keep direct output (such as readline's echo) ordered after
+	// anything already logged by cprintf.
+	klog_drain();
 	cons_putc(c);
 }
 
@@ -462,9 +613,38 @@ int
 getchar(void)
 {
 	int c;
+	uint32_t eflags;
+	bool locked;
 
-	while ((c = cons_getc()) == 0)
-		/* do nothing */;
+	// The kernel is about to wait: a good time to flush the log.
+	klog_drain();
+
+	if (!cons_irq || panicstr) {
+		while ((c = cons_getc()) == 0)
+			/* do nothing */;
+		return c;
+	}
+
+	// Sleep until the keyboard or serial IRQ delivers input.
+	// Check the buffer with interrupts off, then "sti; hlt":
+	// sti takes effect only after the next instruction, so an
+	// interrupt arriving after the check still wakes the hlt.
+	eflags = read_eflags();
+	while (1) {
+		asm volatile("cli");
+		if ((c = cons_getc()) != 0)
+			break;
+		// Interrupt handlers may have logged something meanwhile.
+		klog_drain();
+		// Let other CPUs into the kernel while this one waits.
+		if ((locked = kernel_lock_held()))
+			unlock_kernel();
+		asm volatile("sti; hlt");
+		asm volatile("cli");
+		if (locked)
+			lock_kernel();
+	}
+	write_eflags(eflags);
 	return c;
 }
 
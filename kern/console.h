@@ -18,7 +18,11 @@
 #define CRT_SIZE	(CRT_ROWS * CRT_COLS)
 
 void cons_init(void);
+void cons_irq_init(void);
+bool cons_ready(void);
+void cons_write(const char *s, size_t n);
 int cons_getc(void);
+uint32_t cons_dropped(void);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
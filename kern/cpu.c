@@ -0,0 +1,210 @@
+// CPU feature detection and boot-time selection of hot routines.
+//
+// cpu_init decodes CPUID into cpufeat, enables SSE when the CPU has it,
+// and points memcpy/memset, the string scanning routines and page_zero
+// at the best implementation for this CPU.
+
+#include <inc/mmu.h>
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+
+#include <kern/cpu.h>
+
+struct CpuFeatures cpufeat;
+
+// Registers in the order the decoder table refers to them
+enum { EAX, EBX, ECX, EDX };
+
+// Where each feature flag lives in the CPUID output.  'leaf' is an
+// index into the leaves[] array filled in by cpu_init.
+enum { LEAF_1, LEAF_7, LEAF_EXT1, LEAF_EXT7, NLEAVES };
+
+#define FEATURE(field, leaf, reg, bit) \
+	{ #field, offsetof(struct CpuFeatures, field), leaf, reg, bit }
+
+static const struct {
+	const char *name;
+	size_t offset;		// of the bool in struct CpuFeatures
+	int leaf;
+	int reg;
+	int bit;
+} features[] = {
+	FEATURE(sse2, LEAF_1, EDX, 26),
+	FEATURE(erms, LEAF_7, EBX, 9),
+	FEATURE(fsrm, LEAF_7, EDX, 4),
+	FEATURE(pse, LEAF_1, EDX, 3),
+	FEATURE(pge, LEAF_1, EDX, 13),
+	FEATURE(pat, LEAF_1, EDX, 16),
+	FEATURE(invtsc, LEAF_EXT7, EDX, 8),
+	FEATURE(x2apic, LEAF_1, ECX, 21),
+	FEATURE(mwait, LEAF_1, ECX, 3),
+	FEATURE(rdtscp, LEAF_EXT1, EDX, 27),
+	FEATURE(apic, LEAF_1, EDX, 9),
+	FEATURE(tscdeadline, LEAF_1, ECX, 24),
+};
+
+static bool *
+feature_flag(int i)
+{
+	return (bool *) ((char *) &cpufeat + features[i].offset);
+}
+
+static void page_zero_rep(void *pg);
+static void page_zero_erms(void *pg);
+static void page_zero_nt(void *pg);
+
+enum { ZERO_REP, ZERO_ERMS, ZERO_NT };
+
+static const struct {
+	const char *name;
+	void (*zero)(void *pg);
+} page_zeroers[] = {
+	[ZERO_REP] = { "rep", page_zero_rep },
+	[ZERO_ERMS] = { "erms", page_zero_erms },
+	[ZERO_NT] = { "sse2-nt", page_zero_nt },
+};
+
+static int page_zeroer;
+
+void
+cpu_init(void)
+{
+	uint32_t leaves[NLEAVES][4] = { { 0 } };
+	uint32_t *r, eax, vendor[3];
+	int i;
+
+	cpuid(0, &cpufeat.maxleaf, &vendor[0], &vendor[2], &vendor[1]);
+	memmove(cpufeat.vendor, vendor, 12);
+	cpufeat.vendor[12] = '\0';
+
+	r = leaves[LEAF_1];
+	cpuid(1, &eax, &r[EBX], &r[ECX], &r[EDX]);
+	cpufeat.stepping = eax & 0xF;
+	cpufeat.model = (eax >> 4) & 0xF;
+	cpufeat.family = (eax >> 8) & 0xF;
+	if (cpufeat.family == 0xF)
+		cpufeat.family += (eax >> 20) & 0xFF;
+	if (cpufeat.family >= 6)
+		cpufeat.model |= ((eax >> 16) & 0xF) << 4;
+
+	if (cpufeat.maxleaf >= 7) {
+		r = leaves[LEAF_7];
+		cpuid(7, &r[EAX], &r[EBX], &r[ECX], &r[EDX]);
+	}
+	cpuid(0x80000000, &cpufeat.maxextleaf, NULL, NULL, NULL);
+	if (cpufeat.maxextleaf >= 0x80000001) {
+		r = leaves[LEAF_EXT1];
+		cpuid(0x80000001, &r[EAX], &r[EBX], &r[ECX], &r[EDX]);
+	}
+	if (cpufeat.maxextleaf >= 0x80000007) {
+		r = leaves[LEAF_EXT7];
+		cpuid(0x80000007, &r[EAX], &r[EBX], &r[ECX], &r[EDX]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(features); i++)
+		*feature_flag(i) = (leaves[features[i].leaf][features[i].reg]
+				    >> features[i].bit) & 1;
+
+	cpu_init_percpu();
+
+	// Large copies and fills: rep movsb/stosb when the CPU makes them
+	// fast, else SSE2, else rep movsl/stosl.
+	if (cpufeat.fsrm)
+		string_set_variant(STRING_FSRM);
+	else if (cpufeat.erms)
+		string_set_variant(STRING_ERMS);
+	else if (cpufeat.sse2)
+		string_set_variant(STRING_SSE2);
+	else
+		string_set_variant(STRING_REP);
+
+	string_set_scan(cpufeat.sse2 ? STRSCAN_SSE2 : STRSCAN_SWAR);
+
+	// A page that is being zeroed is rarely read again soon, so
+	// non-temporal stores that bypass the cache are best.
+	if (cpufeat.sse2)
+		page_zeroer = ZERO_NT;
+	else if (cpufeat.erms)
+		page_zeroer = ZERO_ERMS;
+	else
+		page_zeroer = ZERO_REP;
+}
+
+// Set up the control registers of the CPU running this code.  Each
+// CPU calls this once; the boot CPU calls it from cpu_init.
+void
+cpu_init_percpu(void)
+{
+	// Let the kernel use SSE registers.  The kernel never switches
+	// between contexts that use them, and it takes interrupts only
+	// while a CPU waits in hlt or mwait, so no handler can run in
+	// the middle of SSE code; there is nothing to save.  (Profiler
+	// NMIs do arrive anywhere, but prof_tick does not touch them.)
+	if (cpufeat.sse2) {
+		lcr0((rcr0() & ~(CR0_EM | CR0_TS)) | CR0_MP);
+		lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	}
+}
+
+void
+cpu_print(void)
+{
+	int i;
+
+	cprintf("CPU: %s family %u model %u stepping %u\n", cpufeat.vendor,
+		cpufeat.family, cpufeat.model, cpufeat.stepping);
+	cprintf("  features:");
+	for (i = 0; i < ARRAY_SIZE(features); i++)
+		if (*feature_flag(i))
+			cprintf(" %s", features[i].name);
+	cprintf("\n");
+	cprintf("  memcpy/memset %s, string scan %s, page zero %s\n",
+		string_variant_name(), string_scan_name(),
+		page_zeroers[page_zeroer].name);
+}
+
+void
+page_zero(void *pg)
+{
+	page_zeroers[page_zeroer].zero(pg);
+}
+
+static void
+page_zero_rep(void *pg)
+{
+	uint32_t n = PGSIZE / 4;
+
+	asm volatile("cld; rep stosl\n"
+		: "+D" (pg), "+c" (n) : "a" (0) : "cc", "memory");
+}
+
+static void
+page_zero_erms(void *pg)
+{
+	uint32_t n = PGSIZE;
+
+	asm volatile("cld; rep stosb\n"
+		: "+D" (pg), "+c" (n) : "a" (0) : "cc", "memory");
+}
+
+// Non-temporal 16-byte stores, 64 bytes per iteration.  The sfence
+// orders them before any later ordinary stores.
+__attribute__((target("sse2")))
+static void
+page_zero_nt(void *pg)
+{
+	uint32_t n = PGSIZE / 64;
+
+	asm volatile("pxor %%xmm0, %%xmm0\n"
+		     "1:\n"
+		     "movntdq %%xmm0, (%0)\n"
+		     "movntdq %%xmm0, 16(%0)\n"
+		     "movntdq %%xmm0, 32(%0)\n"
+		     "movntdq %%xmm0, 48(%0)\n"
+		     "add $64, %0\n"
+		     "dec %1\n"
+		     "jnz 1b\n"
+		     "sfence\n"
+		     : "+r" (pg), "+r" (n) : : "xmm0", "cc", "memory");
+}
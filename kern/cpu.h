@@ -0,0 +1,98 @@
+#ifndef JOS_KERN_CPU_H
+#define JOS_KERN_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/mmu.h>
+
+// Maximum number of CPUs
+#define NCPU		8
+
+// Values of status in struct CpuInfo
+enum {
+	CPU_UNUSED = 0,
+	CPU_STARTED,
+	CPU_HALTED,
+};
+
+// Per-CPU state
+struct CpuInfo {
+	uint8_t cpu_id;			// Index into cpus[] below
+	uint32_t cpu_apicid;		// Local APIC ID
+	volatile unsigned cpu_status;	// The status of the CPU
+	struct Taskstate cpu_ts;	// Used by x86 to find stack for interrupt
+};
+
+// Initialized in mpconfig.c
+extern struct CpuInfo cpus[NCPU];
+extern int ncpu;			// Total number of CPUs in the system
+extern struct CpuInfo *bootcpu;		// The boot-strap processor (BSP)
+extern physaddr_t lapicaddr;		// Physical MMIO address of the local APIC
+
+extern const char *mp_source;		// "ACPI", "MP" or NULL
+
+// Per-CPU kernel stacks
+extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
+
+// Top of CPU i's kernel stack, as mapped below KSTACKTOP
+#define KSTACKTOP_CPU(i)	(KSTACKTOP - (i) * (KSTKSIZE + KSTKGAP))
+
+// The CpuInfo of the CPU running this code
+#define thiscpu (&cpus[cpunum()])
+
+// CPU features the kernel cares about, decoded from CPUID once at boot.
+struct CpuFeatures {
+	char vendor[13];
+	uint8_t family;
+	uint8_t model;
+	uint8_t stepping;
+	uint32_t maxleaf;	// highest basic CPUID leaf
+	uint32_t maxextleaf;	// highest extended (0x8000xxxx) CPUID leaf
+
+	bool sse2;		// SSE2 instructions
+	bool erms;		// enhanced REP MOVSB/STOSB
+	bool fsrm;		// fast short REP MOVSB
+	bool pse;		// 4MB pages
+	bool pge;		// global pages
+	bool pat;		// page attribute table
+	bool invtsc;		// TSC rate is constant across P- and C-states
+	bool x2apic;		// x2APIC mode
+	bool mwait;		// MONITOR/MWAIT
+	bool rdtscp;		// RDTSCP instruction
+	bool apic;		// on-chip local APIC
+	bool tscdeadline;	// LAPIC timer TSC-deadline mode
+};
+
+extern struct CpuFeatures cpufeat;
+
+void cpu_init(void);
+void cpu_init_percpu(void);
+void cpu_print(void);
+
+// Zero one page-aligned page of memory.
+void page_zero(void *pg);
+
+void mp_init(void);
+
+// The local APIC (kern/lapic.c).  lapic is NULL if there is none.
+extern volatile uint32_t *lapic;
+extern bool lapic_x2apic;		// registers are MSRs, not MMIO
+extern uint32_t lapic_timer_khz;	// LAPIC timer ticks per millisecond
+
+int cpunum(void);
+void lapic_init(void);
+void lapic_print(void);
+void lapic_eoi(void);
+void lapic_maskpic(void);
+void lapic_startap(uint32_t apicid, uint32_t addr);
+void lapic_ipi(int cpu, int vector);
+void lapic_nmi(int cpu);
+void msi_compose(int cpu, int vector, uint32_t *addr, uint32_t *data);
+bool lapic_timer_ok(void);
+void lapic_timer_arm(uint64_t cycles);
+void lapic_timer_stop(void);
+
+#endif	// !JOS_KERN_CPU_H
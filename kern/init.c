@@ -3,9 +3,21 @@
 #include <inc/stdio.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/monitor.h>
 #include <kern/console.h>
+#include <kern/trap.h>
+#include <kern/picirq.h>
+#include <kern/klog.h>
+#include <kern/cpu.h>
+#include <kern/pmu.h>
+#include <kern/kclock.h>
+#include <kern/ioapic.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+#include <kern/percpu.h>
+#include <kern/sched.h>
 
 // Test the stack backtrace function (lab 1 only)
 void
@@ -19,24 +31,106 @@ test_backtrace(int x)
 	cprintf("leaving test_backtrace %d\n", x);
 }
 
+// Time stamps taken as boot reaches each stage, for grade-perf
+static struct {
+	const char *name;
+	uint64_t tsc;
+} boot_probes[8];
+static int nboot_probes;
+
+static void
+boot_probe(const char *name, uint64_t tsc)
+{
+	if (nboot_probes < ARRAY_SIZE(boot_probes)) {
+		boot_probes[nboot_probes].name = name;
+		boot_probes[nboot_probes].tsc = tsc;
+		nboot_probes++;
+	}
+}
+
+// Print how long each stage of boot took.  The first stage, up to
+// kernel entry, counts from CPU reset, so it includes the BIOS and
+// the boot loader.
+static void
+boot_probes_print(void)
+{
+	uint64_t prev = 0;
+	int i;
+
+	for (i = 0; i < nboot_probes; i++) {
+		cprintf("probe boot/%s cycles %llu\n", boot_probes[i].name,
+			boot_probes[i].tsc - prev);
+		prev = boot_probes[i].tsc;
+	}
+}
+
+static void boot_aps(void);
+
 void
 i386_init(void)
 {
 	extern char edata[], end[];
+	uint64_t entry_tsc = read_tsc();
 
 	// Before doing anything else, complete the ELF loading process.
 	// Clear the uninitialized global data (BSS) section of our program.
 	// This ensures that all static/global variables start out zero.
 	memset(edata, 0, end - edata);
+	boot_probe("entry", entry_tsc);
+
+	// Decode the CPU's features and pick the best implementations
+	// of memcpy, memset and friends.
+	cpu_init();
+	pmu_init();
+	boot_probe("cpu_init", read_tsc());
+
+	// Measure the TSC rate, so that cycles can be turned into time.
+	clock_init();
+	boot_probe("clock_init", read_tsc());
 
 	// Initialize the console.
-	// Can't call cprintf until after we do this!
+	// cprintf output is held in the kernel log until we do this.
 	cons_init();
+	boot_probe("cons_init", read_tsc());
 
 	cprintf("6828 decimal is %o octal!\n", 6828);
 
+	// Set up the IDT and the interrupt controller, and let the
+	// console take its input from interrupts instead of polling.
+	// Find the CPUs and I/O APICs, and move interrupt delivery from
+	// the 8259A to the APICs when there are any.  The LAPIC timer
+	// drives the kernel's timers.  Each CPU's per-CPU data area
+	// must exist before trap_init loads its segment.
+	mp_init();
+	percpu_init();
+	sched_init();
+	trap_init();
+	pic_init();
+	lapic_init();
+	ioapic_init();
+	cons_irq_init();
+	boot_probe("trap_init", read_tsc());
+
+	// Acquire the big kernel lock before waking up APs
+	lock_kernel();
+
+	// Starting non-boot CPUs
+	mem_init_mp();
+	boot_aps();
+	boot_probe("boot_aps", read_tsc());
+
 	// Test the stack backtrace function (lab 1 only)
 	test_backtrace(5);
+	klog_drain();
+	boot_probe("backtrace", read_tsc());
+
+#ifdef JOS_PERF
+	// Built by 'make perf': report to grade-perf and stop.
+	boot_probes_print();
+	monitor_cmd("bench all", NULL);
+	cprintf("perf: done\n");
+	klog_drain();
+#endif
 
 	// Drop into the kernel monitor.
 	while (1)
@@ -44,6 +138,76 @@ i386_init(void)
 }
 
 
+// While boot_aps is booting a given CPU, it communicates the per-core
+// stack pointer that should be loaded by mpentry.S to that CPU in
+// this variable.
+void *mpentry_kstack;
+
+#define AP_TIMEOUT_MS	100	// give up on a CPU that does not start
+
+// Start the non-boot (AP) processors.
+static void
+boot_aps(void)
+{
+	extern unsigned char mpentry_start[], mpentry_end[];
+	void *code;
+	struct CpuInfo *c;
+	uint64_t start;
+
+	bootcpu->cpu_status = CPU_STARTED;
+	if (!lapic)
+		return;
+
+	// Write entry code to unused memory at MPENTRY_PADDR
+	code = KADDR(MPENTRY_PADDR);
+	memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+	// Boot each AP one at a time.  A CPU that misses the timeout may
+	// still start later, on the stack in mpentry_kstack, so that
+	// stack cannot be handed to another CPU: stop there.
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == bootcpu)  // We've started already.
+			continue;
+
+		// Tell mpentry.S what stack to use
+		mpentry_kstack = (void *) KSTACKTOP_CPU(c - cpus);
+		// Start the CPU at mpentry_start
+		lapic_startap(c->cpu_apicid, PADDR(code));
+		// Wait for the CPU to finish some basic setup in mp_main(),
+		// then measure its TSC against ours.  A CPU that starts
+		// too late waits in clock_sync_ap for good.
+		start = read_tsc();
+		while (c->cpu_status != CPU_STARTED)
+			if (tsc_khz && read_tsc() - start
+			    > (uint64_t) tsc_khz * AP_TIMEOUT_MS) {
+				cprintf("SMP: CPU %d did not start; "
+					"not starting the rest\n", c->cpu_id);
+				return;
+			}
+		clock_sync_bsp();
+	}
+}
+
+// Setup code for APs
+void
+mp_main(void)
+{
+	// The LAPIC comes first: cpunum() needs it.
+	lapic_init();
+	cpu_init_percpu();
+	trap_init_percpu();
+	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+	clock_sync_ap();
+
+	// Now that we have finished some basic setup, take the big
+	// kernel lock to print, then run kernel tasks and the interrupt
+	// handlers for the IRQs steered to this CPU.
+	lock_kernel();
+	cprintf("SMP: CPU %d starting\n", cpunum());
+	unlock_kernel();
+	sched_idle();
+}
+
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
  * to indicate that the kernel has already called panic.
@@ -72,6 +236,10 @@ _panic(const char *file, int line, const char *fmt,...)
 	cprintf("\n");
 	va_end(ap);
 
+	// Get everything in the log out, including the message above.
+	// The log itself stays intact for 'dmesg'.
+	klog_drain();
+
 dead:
 	/* break into the kernel monitor */
 	while (1)
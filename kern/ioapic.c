@@ -0,0 +1,216 @@
+// The I/O APIC manages hardware interrupts for an SMP system.
+// http://www.intel.com/design/chipsets/datashts/29056601.pdf
+//
+// ioapic_init masks the 8259A and routes each ISA IRQ through the
+// I/O APICs found by mp_init instead, to vector IRQ_OFFSET+irq on a
+// chosen CPU.  Interrupts are then acknowledged with a single LAPIC
+// EOI, and enabling or disabling one is a write to its redirection
+// entry rather than a read-modify-write of the 8259A masks.
+
+#include <inc/types.h>
+#include <inc/trap.h>
+#include <inc/x86.h>
+#include <inc/stdio.h>
+
+#include <kern/ioapic.h>
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+#include <kern/picirq.h>
+
+#define IOREGSEL	(0x00/4)	// register select
+#define IOWIN		(0x10/4)	// register data
+
+#define REG_ID		0x00	// Register index: ID
+#define REG_VER		0x01	// Register index: version
+#define REG_TABLE	0x10	// Redirection table base
+
+// The redirection table starts at REG_TABLE and uses
+// two registers to configure each interrupt.
+// The first (low) register in a pair contains configuration bits.
+// The second (high) register contains a bitmask telling which
+// CPUs can serve that interrupt.
+#define INT_DISABLED	0x00010000	// Interrupt disabled
+#define INT_LEVEL	0x00008000	// Level-triggered (vs edge-)
+#define INT_ACTIVELOW	0x00002000	// Active low (vs high)
+#define INT_LOGICAL	0x00000800	// Destination is CPU id (vs APIC ID)
+#define INT_NMI		0x00000400	// Deliver as an NMI (vector ignored)
+
+bool ioapic_active;
+
+// The CPU each ISA IRQ is routed to, and which are enabled
+static int irq_cpu[16];
+static uint16_t irq_on;
+static uint16_t irq_nmi;	// delivered as NMIs
+
+static uint32_t
+ioapic_read(struct IoapicInfo *io, int reg)
+{
+	io->regs[IOREGSEL] = reg;
+	return io->regs[IOWIN];
+}
+
+static void
+ioapic_write(struct IoapicInfo *io, int reg, uint32_t data)
+{
+	io->regs[IOREGSEL] = reg;
+	io->regs[IOWIN] = data;
+}
+
+// Find the I/O APIC and pin that global system interrupt 'gsi'
+// arrives on.
+static struct IoapicInfo *
+ioapic_find(uint32_t gsi, int *pin)
+{
+	int i;
+
+	for (i = 0; i < nioapic; i++)
+		if (gsi >= ioapics[i].gsibase
+		    && gsi < ioapics[i].gsibase + ioapics[i].nredir) {
+			*pin = gsi - ioapics[i].gsibase;
+			return &ioapics[i];
+		}
+	return NULL;
+}
+
+// Write ISA IRQ 'irq''s redirection entry: to vector IRQ_OFFSET+irq,
+// or as an NMI, on CPU 'cpu', masked if 'mask' is set.
+static void
+ioapic_route(int irq, int cpu, uint32_t mask)
+{
+	struct IoapicInfo *io;
+	uint32_t lo;
+	int pin;
+
+	if ((io = ioapic_find(isa_irqs[irq].gsi, &pin)) == NULL) {
+		cprintf("ioapic: IRQ %d: no I/O APIC has GSI %u\n",
+			irq, isa_irqs[irq].gsi);
+		return;
+	}
+	lo = mask | (IRQ_OFFSET + irq);
+	if (irq_nmi & (1 << irq))
+		lo |= INT_NMI;
+	if (isa_irqs[irq].flags & IRQ_TRIGGER_LEVEL)
+		lo |= INT_LEVEL;
+	if (isa_irqs[irq].flags & IRQ_POLARITY_LOW)
+		lo |= INT_ACTIVELOW;
+	// Mask the entry while it changes, so that no interrupt is sent
+	// with half of the new setting.
+	ioapic_write(io, REG_TABLE+2*pin, INT_DISABLED);
+	ioapic_write(io, REG_TABLE+2*pin+1, cpus[cpu].cpu_apicid << 24);
+	ioapic_write(io, REG_TABLE+2*pin, lo);
+}
+
+void
+ioapic_init(void)
+{
+	struct IoapicInfo *io;
+	uint16_t pic_mask = irq_mask_8259A;
+	int i, pin;
+
+	if (nioapic == 0 || !lapic)
+		return;
+
+	for (i = 0; i < nioapic; i++) {
+		io = &ioapics[i];
+		io->regs = mmio_map_region(io->addr, PGSIZE);
+		io->nredir = ((ioapic_read(io, REG_VER) >> 16) & 0xFF) + 1;
+		// The MP tables do not number the pins; count on from
+		// the previous I/O APIC.
+		if (i > 0 && io->gsibase == 0)
+			io->gsibase = ioapics[i-1].gsibase + ioapics[i-1].nredir;
+		// Mark all interrupts edge-triggered, active high, disabled,
+		// and not routed to any CPUs.
+		for (pin = 0; pin < io->nredir; pin++) {
+			ioapic_write(io, REG_TABLE+2*pin, INT_DISABLED);
+			ioapic_write(io, REG_TABLE+2*pin+1, 0);
+		}
+	}
+
+	// [MP 3.2.6.1] If the hardware implements PIC mode, switch
+	// to getting interrupts from the APICs.
+	if (mp_imcrp) {
+		outb(0x22, 0x70);		// Select IMCR
+		outb(0x23, inb(0x23) | 1);	// Mask external interrupts.
+	}
+
+	// Silence the 8259A and take over the IRQs it had enabled.
+	outb(IO_PIC1+1, 0xFF);
+	outb(IO_PIC2+1, 0xFF);
+	lapic_maskpic();
+	ioapic_active = 1;
+	for (i = 0; i < ARRAY_SIZE(irq_cpu); i++) {
+		irq_cpu[i] = bootcpu->cpu_id;
+		if (i != IRQ_SLAVE && !(pic_mask & (1 << i)))
+			ioapic_enable(i);
+	}
+}
+
+void
+ioapic_enable(int irq)
+{
+	irq_on |= 1 << irq;
+	ioapic_route(irq, irq_cpu[irq], 0);
+}
+
+void
+ioapic_disable(int irq)
+{
+	irq_on &= ~(1 << irq);
+	ioapic_route(irq, irq_cpu[irq], INT_DISABLED);
+}
+
+// Deliver ISA IRQ 'irq' to CPU 'cpu' from now on.
+void
+ioapic_steer(int irq, int cpu)
+{
+	irq_cpu[irq] = cpu;
+	ioapic_route(irq, cpu, (irq_on & (1 << irq)) ? 0 : INT_DISABLED);
+}
+
+// The CPU that ISA IRQ 'irq' is delivered to
+int
+ioapic_cpu(int irq)
+{
+	return irq_cpu[irq];
+}
+
+// Deliver ISA IRQ 'irq' as an NMI if 'on' is set, which reaches the CPU
+// even while it runs with interrupts disabled, or as a normal
+// interrupt if not.  Only edge-triggered IRQs can be NMIs.
+void
+ioapic_nmi(int irq, bool on)
+{
+	if (on)
+		irq_nmi |= 1 << irq;
+	else
+		irq_nmi &= ~(1 << irq);
+	ioapic_route(irq, irq_cpu[irq], (irq_on & (1 << irq)) ? 0 : INT_DISABLED);
+}
+
+void
+ioapic_print(void)
+{
+	struct IoapicInfo *io;
+	uint32_t lo;
+	int i, irq, pin;
+
+	if (!ioapic_active) {
+		cprintf("IOAPIC: none in use, interrupts from the 8259A\n");
+		return;
+	}
+	for (i = 0; i < nioapic; i++)
+		cprintf("IOAPIC: id %u at %08x, GSIs %u-%u\n", ioapics[i].id,
+			ioapics[i].addr, ioapics[i].gsibase,
+			ioapics[i].gsibase + ioapics[i].nredir - 1);
+	for (irq = 0; irq < ARRAY_SIZE(isa_irqs); irq++) {
+		if ((io = ioapic_find(isa_irqs[irq].gsi, &pin)) == NULL)
+			continue;
+		lo = ioapic_read(io, REG_TABLE+2*pin);
+		if (lo & INT_DISABLED)
+			continue;
+		cprintf("  IRQ %2d: GSI %2u, %s, active %s, CPU %d%s\n", irq,
+			isa_irqs[irq].gsi, (lo & INT_LEVEL) ? "level" : "edge",
+			(lo & INT_ACTIVELOW) ? "low" : "high", irq_cpu[irq],
+			(lo & INT_NMI) ? ", NMI" : "");
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef JOS_KERN_IOAPIC_H
+#define JOS_KERN_IOAPIC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#define NIOAPIC		4	// maximum number of I/O APICs
+
+// An I/O APIC, as described by the MP or ACPI tables (mpconfig.c)
+struct IoapicInfo {
+	uint8_t id;
+	physaddr_t addr;		// physical MMIO address
+	uint32_t gsibase;		// first global system interrupt
+	volatile uint32_t *regs;	// mapped by ioapic_init
+	uint32_t nredir;		// redirection table entries
+};
+
+#define IRQ_POLARITY_LOW	0x1	// active low (ISA default: high)
+#define IRQ_TRIGGER_LEVEL	0x2	// level triggered (ISA default: edge)
+
+// Where each of the 16 ISA IRQs arrives at the I/O APICs
+struct IsaIrq {
+	uint32_t gsi;			// global system interrupt
+	uint8_t flags;			// IRQ_POLARITY_LOW, IRQ_TRIGGER_LEVEL
+};
+
+extern struct IoapicInfo ioapics[NIOAPIC];
+extern int nioapic;
+extern struct IsaIrq isa_irqs[16];
+extern bool mp_imcrp;			// the IMCR selects PIC or APIC mode
+
+// Set once ioapic_init has taken over from the 8259A.
+extern bool ioapic_active;
+
+void ioapic_init(void);
+void ioapic_enable(int irq);
+void ioapic_disable(int irq);
+void ioapic_steer(int irq, int cpu);
+int ioapic_cpu(int irq);
+void ioapic_nmi(int irq, bool on);
+void ioapic_print(void);
+
+#endif	// !JOS_KERN_IOAPIC_H
@@ -0,0 +1,219 @@
+/* See COPYRIGHT for copyright information. */
+
+// Support for the PIT, which drives IRQ_TIMER, and for the clock.
+
+#include <inc/x86.h>
+#include <inc/trap.h>
+#include <inc/stdio.h>
+
+#include <kern/kclock.h>
+#include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/percpu.h>
+
+// Make PIT counter 0 interrupt 'hz' times a second (as nearly as the
+// 16-bit divisor allows) and unmask IRQ_TIMER.
+void
+pit_start(unsigned hz)
+{
+	uint32_t div = TIMER_FREQ / hz;
+
+	if (div > 0xFFFF)
+		div = 0;	// 0 counts as 65536
+	else if (div < 2)
+		div = 2;
+	outb(TIMER_MODE, TIMER_SEL0 | TIMER_RATEGEN | TIMER_16BIT);
+	outb(IO_TIMER1, div & 0xFF);
+	outb(IO_TIMER1, div >> 8);
+	irq_enable(IRQ_TIMER);
+}
+
+// Mask IRQ_TIMER again.
+void
+pit_stop(void)
+{
+	irq_disable(IRQ_TIMER);
+}
+
+
+// TSC calibration and conversion to nanoseconds.
+//
+// clock_init times a PIT counter 2 countdown with the TSC.  The PIT
+// runs from its own fixed-frequency crystal, so the countdown takes a
+// known time.  If there is no PIT, the TSC frequency reported by CPUID
+// leaf 0x16 is used instead.  Conversions use a fixed-point multiplier,
+// so that they need no 64-bit division:
+//
+//	ns = cycles * clock.mult >> clock.shift
+
+#define CALIBRATE_MS	10	// length of one PIT countdown
+#define CALIBRATE_RUNS	3	// keep the shortest of this many
+#define SYNC_ROUNDS	16	// TSC exchanges per AP; keep the fastest
+
+uint32_t tsc_khz;
+
+// This CPU's TSC minus the boot CPU's, measured by clock_sync_ap
+static DEFINE_PERCPU(int64_t, tsc_offset);
+
+// The TSC exchange between the boot CPU and a starting AP
+static volatile uint32_t sync_req;	// round the AP is asking for
+static volatile uint32_t sync_ack;	// round the boot CPU has answered
+static volatile uint64_t sync_tsc;	// the boot CPU's answer
+
+static struct {
+	uint64_t base;		// TSC at calibration: clock_ns() == 0
+	uint32_t mult;
+	uint32_t shift;
+	const char *source;	// how tsc_khz was found
+} clock;
+
+// Return the TSC ticks in one PIT countdown of 'ms' milliseconds, or 0
+// if the countdown never finishes.
+static uint64_t
+pit_calibrate(uint32_t ms)
+{
+	uint32_t latch = TIMER_FREQ / (1000 / ms), i;
+	uint64_t start;
+
+	// Gate counter 2 on, with the speaker off, and load it in mode 0:
+	// its output goes high when the count reaches zero.
+	outb(IO_PPI, (inb(IO_PPI) & ~PPI_SPKR) | PPI_GATE2);
+	outb(TIMER_MODE, TIMER_SEL2 | TIMER_INTTC | TIMER_16BIT);
+	outb(IO_TIMER1 + 2, latch & 0xFF);
+	outb(IO_TIMER1 + 2, latch >> 8);
+	start = read_tsc();
+	for (i = 0; !(inb(IO_PPI) & PPI_OUT2); i++)
+		if (i == 10000000)
+			return 0;
+	return read_tsc() - start;
+}
+
+void
+clock_init(void)
+{
+	uint64_t best = 0, t;
+	uint32_t eax, ebx, ecx;
+	int i;
+
+	for (i = 0; i < CALIBRATE_RUNS; i++)
+		if ((t = pit_calibrate(CALIBRATE_MS)) != 0 && (!best || t < best))
+			best = t;
+	if (best) {
+		tsc_khz = best / CALIBRATE_MS;
+		clock.source = "PIT";
+	} else if (cpufeat.maxleaf >= 0x16) {
+		// Base frequency in MHz, in EAX
+		cpuid(0x16, &eax, &ebx, &ecx, NULL);
+		tsc_khz = eax * 1000;
+		clock.source = "CPUID";
+	}
+	clock.base = read_tsc();
+	if (tsc_khz == 0) {
+		cprintf("clock: cannot determine the TSC frequency\n");
+		return;
+	}
+
+	// Use the largest shift (most precision) that keeps mult in 32 bits.
+	for (clock.shift = 32; clock.shift > 0; clock.shift--)
+		if ((1000000ULL << clock.shift) / tsc_khz <= 0xFFFFFFFF)
+			break;
+	clock.mult = (1000000ULL << clock.shift) / tsc_khz;
+}
+
+void
+clock_print(void)
+{
+	int i;
+
+	if (tsc_khz == 0) {
+		cprintf("TSC: frequency unknown\n");
+		return;
+	}
+	cprintf("TSC: %u.%03u MHz (%s)%s\n", tsc_khz / 1000, tsc_khz % 1000,
+		clock.source, cpufeat.invtsc ? ", invariant" :
+		", not invariant: rate may vary with power state");
+	for (i = 0; i < ncpu; i++)
+		if (i != bootcpu->cpu_id && cpus[i].cpu_status == CPU_STARTED)
+			cprintf("  CPU %d: TSC offset %lld cycles\n", i,
+				*per_cpu_ptr(&tsc_offset, i));
+}
+
+// Measure the offset of an AP's TSC from the boot CPU's.  The AP calls
+// clock_sync_ap while the boot CPU waits in clock_sync_bsp.  In each
+// round the AP asks for the boot CPU's TSC and takes its own before and
+// after; the answer was read about halfway between the two.  The round
+// with the shortest trip bounds the error most tightly.
+void
+clock_sync_bsp(void)
+{
+	uint32_t r;
+
+	for (r = 1; r <= SYNC_ROUNDS; r++) {
+		while (sync_req != r)
+			asm volatile("pause");
+		sync_tsc = read_tsc();
+		sync_ack = r;
+	}
+	// Wait for the AP to read the last answer before the next AP
+	// starts over.
+	while (sync_req != 0)
+		asm volatile("pause");
+	sync_ack = 0;
+}
+
+void
+clock_sync_ap(void)
+{
+	uint64_t before, after, best = ~0ULL;
+	int64_t offset = 0;
+	uint32_t r;
+
+	for (r = 1; r <= SYNC_ROUNDS; r++) {
+		before = read_tsc();
+		sync_req = r;
+		while (sync_ack != r)
+			asm volatile("pause");
+		after = read_tsc();
+		if (after - before < best) {
+			best = after - before;
+			offset = (int64_t) (before + best / 2 - sync_tsc);
+		}
+	}
+	sync_req = 0;
+	this_cpu_write(tsc_offset, offset);
+}
+
+// Convert a number of TSC cycles to nanoseconds.  Returns 0 if the TSC
+// frequency is unknown.
+uint64_t
+clock_cycles_to_ns(uint64_t cycles)
+{
+	uint32_t lo = cycles, hi = cycles >> 32;
+
+	return ((uint64_t) lo * clock.mult >> clock.shift)
+		+ ((uint64_t) hi * clock.mult << (32 - clock.shift));
+}
+
+// Convert nanoseconds to TSC cycles, without overflow for any
+// realistic interval.
+uint64_t
+clock_ns_to_cycles(uint64_t ns)
+{
+	return ns / 1000000 * tsc_khz + ns % 1000000 * tsc_khz / 1000000;
+}
+
+// Return the TSC relative to boot.  This is the kernel's monotonic
+// timestamp; when there are several CPUs, each corrects for the offset
+// of its own TSC here, so that timestamps agree across CPUs.
+uint64_t
+clock_tsc(void)
+{
+	return read_tsc() - this_cpu_read(tsc_offset) - clock.base;
+}
+
+// Return nanoseconds since the clock was calibrated.
+uint64_t
+clock_ns(void)
+{
+	return clock_cycles_to_ns(clock_tsc());
+}
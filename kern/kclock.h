@@ -0,0 +1,48 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KCLOCK_H
+#define JOS_KERN_KCLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// The CMOS real-time clock, whose NVRAM holds the shutdown code
+#define IO_RTC		0x070		// RTC port
+
+// The 8253/8254 programmable interval timer (PIT)
+#define IO_TIMER1	0x040		// timer 1 counters
+#define TIMER_MODE	(IO_TIMER1 + 3)	// timer mode port
+#define TIMER_FREQ	1193182		// input clock, in Hz
+
+#define TIMER_SEL0	0x00		// select counter 0
+#define TIMER_SEL2	0x80		// select counter 2
+#define TIMER_INTTC	0x00		// mode 0, interrupt on terminal count
+#define TIMER_RATEGEN	0x04		// mode 2, rate generator
+#define TIMER_16BIT	0x30		// r/w counter 16 bits, LSB first
+
+// Counter 2 is gated and read back through the keyboard controller's
+// port B.
+#define IO_PPI		0x061		// port B
+#define PPI_GATE2	0x01		// counter 2 gate
+#define PPI_SPKR	0x02		// counter 2 drives the speaker
+#define PPI_OUT2	0x20		// counter 2 output (read-only)
+
+void pit_start(unsigned hz);
+void pit_stop(void);
+
+// Time.  clock_init measures the TSC rate at boot; after that, TSC
+// readings can be converted to nanoseconds.
+extern uint32_t tsc_khz;	// TSC ticks per millisecond; 0 if unknown
+
+void clock_init(void);
+void clock_print(void);
+void clock_sync_bsp(void);
+void clock_sync_ap(void);
+uint64_t clock_tsc(void);
+uint64_t clock_ns(void);
+uint64_t clock_cycles_to_ns(uint64_t cycles);
+uint64_t clock_ns_to_cycles(uint64_t ns);
+
+#endif	// !JOS_KERN_KCLOCK_H
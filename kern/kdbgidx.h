@@ -0,0 +1,61 @@
+#ifndef JOS_KERN_KDBGIDX_H
+#define JOS_KERN_KDBGIDX_H
+
+#include <inc/types.h>
+
+// Address-to-line index for debuginfo_eip, generated from the kernel's
+// stabs at build time by kern/mkdbgidx.pl and linked into the kernel as
+// the .kdbgidx section.  Offsets are in bytes from the start of the
+// index.  The layout is:
+//
+//	struct KdbgIndex	header
+//	uint32_t addr[nfunc]	start address of each region, sorted
+//	struct KdbgFunc func[nfunc]
+//	uint8_t lines[]		line programs
+//	char strtab[]		NUL-terminated names; offset 0 is ""
+//
+// A region is a function or, in assembly files, which have no function
+// stabs, the whole file (name 0).  Its line program is a sequence of
+// records that each begin with uleb128(address delta << 1 | op).  Op 0
+// is followed by sleb128(line delta), op 1 by uleb128(strtab offset of
+// a new file name); a file of 0 ends the program.  Addresses start at
+// the region's start and lines at 0.
+
+#define KDBGIDX_MAGIC	0x5844424B	// "KBDX"
+
+// A kernel built with KDBGDISK=1 does not link the index in.  Instead
+// the index is compressed and written to the disk image starting at
+// this sector (which must match kern/Makefrag), after a struct KdbgBlob
+// header.  The compression is LZSS: each flag byte is followed by up to
+// eight items, one per flag bit from the lowest up.  A 1 bit marks a
+// literal byte; a 0 bit marks a two-byte back reference holding the
+// distance - 1 in 12 bits (the first byte, then the high 4 bits of the
+// second) and the length - 3 in the low 4 bits of the second byte.
+#define KDBGIDX_SECTOR	8192
+#define KDBGBLOB_MAGIC	0x5A44424B	// "KBDZ"
+
+struct KdbgBlob {
+	uint32_t magic;
+	uint32_t size;		// size of the index
+	uint32_t packed;	// bytes of compressed data following
+};
+
+struct KdbgIndex {
+	uint32_t magic;
+	uint32_t nfunc;		// number of regions
+	uint32_t func;		// offset of func[]
+	uint32_t lines;		// offset of the line programs
+	uint32_t strtab;	// offset of the string table
+	uint32_t size;		// size of the whole index
+};
+
+struct KdbgFunc {
+	uint32_t end;		// address just past the region
+	uint32_t name;		// function name, or 0
+	uint32_t file;		// source file at the region's start
+	uint32_t lines;		// line program, relative to 'lines'
+	uint16_t namelen;
+	uint16_t narg;		// number of arguments
+};
+
+#endif	// !JOS_KERN_KDBGIDX_H
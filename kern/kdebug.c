@@ -1,14 +1,20 @@
+#include <inc/stdio.h>
 #include <inc/stab.h>
 #include <inc/string.h>
 #include <inc/memlayout.h>
 #include <inc/assert.h>
 
 #include <kern/kdebug.h>
+#include <kern/kdbgidx.h>
+#include <kern/ide.h>
+#include <kern/percpu.h>
 
 extern const struct Stab __STAB_BEGIN__[];	// Beginning of stabs table
 extern const struct Stab __STAB_END__[];	// End of stabs table
 extern const char __STABSTR_BEGIN__[];		// Beginning of string table
 extern const char __STABSTR_END__[];		// End of string table
+extern const char __KDBGIDX_BEGIN__[];		// Beginning of debug index
+extern const char __KDBGIDX_END__[];		// End of debug index
 
 
 // stab_binsearch(stabs, region_left, region_right, type, addr)
@@ -94,16 +100,225 @@ stab_binsearch(const struct Stab *stabs, int *region_left, int *region_right,
 }
 
 
-// debuginfo_eip(addr, info)
-//
-//	Fill in the 'info' structure with information about the specified
-//	instruction address, 'addr'.  Returns 0 if information was found, and
-//	negative if not.  But even if it returns negative it has stored some
-//	information into '*info'.
-//
+static uint32_t
+uleb128(const uint8_t **p)
+{
+	uint32_t v = 0;
+	int shift = 0;
+
+	do
+		v |= (**p & 0x7f) << shift, shift += 7;
+	while (*(*p)++ & 0x80);
+	return v;
+}
+
+static int32_t
+sleb128(const uint8_t **p)
+{
+	uint32_t v = 0;
+	int shift = 0;
+	uint8_t c;
+
+	do
+		c = *(*p)++, v |= (c & 0x7f) << shift, shift += 7;
+	while (c & 0x80);
+	if (shift < 32 && (c & 0x40))
+		v |= -1U << shift;
+	return v;
+}
+
+// Bytes of debug index read from disk, for mon_kerninfo
+static size_t kdbgidx_loaded;
+
+// Expand 'srclen' bytes of LZSS data (see kern/kdbgidx.h) at 'src' into
+// exactly 'size' bytes at 'dst'.  Returns 0 on success, -1 if the data
+// is malformed.
+static int
+lzss_decode(uint8_t *dst, size_t size, const uint8_t *src, size_t srclen)
+{
+	const uint8_t *send = src + srclen;
+	uint32_t flags = 0, dist, len;
+	size_t n = 0;
+
+	while (n < size) {
+		if (!(flags & 0x100)) {
+			if (src == send)
+				return -1;
+			flags = *src++ | 0xFF00;	// high bits count items
+		}
+		if (flags & 1) {
+			if (src == send)
+				return -1;
+			dst[n++] = *src++;
+		} else {
+			if (send - src < 2)
+				return -1;
+			dist = (src[0] | (src[1] >> 4) << 8) + 1;
+			len = (src[1] & 0xF) + 3;
+			src += 2;
+			if (dist > n || len > size - n)
+				return -1;
+			for (; len > 0; len--, n++)
+				dst[n] = dst[n - dist];
+		}
+		flags >>= 1;
+	}
+	return 0;
+}
+
+// Read the compressed debug index written to the disk image by a
+// KDBGDISK=1 build and expand it just past the end of the kernel.
+// Only the 4MB mapped by entry_pgdir is usable, so the index and the
+// compressed data it is expanded from must both fit below that.
+static const struct KdbgIndex *
+kdbgidx_load(void)
+{
+	extern char end[];
+	struct KdbgBlob *blob;
+	uint8_t *idx, *packed;
+	uint32_t avail, nsecs, secno, n;
+
+	idx = ROUNDUP((uint8_t *) end, SECTSIZE);
+	avail = KERNBASE + PTSIZE - (uintptr_t) idx;
+	blob = (struct KdbgBlob *) idx;
+	if (ide_read(KDBGIDX_SECTOR, blob, 1) < 0
+	    || blob->magic != KDBGBLOB_MAGIC
+	    || blob->size < sizeof(struct KdbgIndex)
+	    || blob->size > avail || blob->packed > avail
+	    || ROUNDUP(blob->size, SECTSIZE)
+	       + ROUNDUP(sizeof(*blob) + blob->packed, SECTSIZE) > avail)
+		return NULL;
+
+	// Read the header sector and the data following it in one piece,
+	// above where the index will be expanded.
+	packed = idx + ROUNDUP(blob->size, SECTSIZE);
+	nsecs = ROUNDUP(sizeof(*blob) + blob->packed, SECTSIZE) / SECTSIZE;
+	for (secno = 0; secno < nsecs; secno += n) {
+		n = MIN(nsecs - secno, 256);
+		if (ide_read(KDBGIDX_SECTOR + secno, packed + secno * SECTSIZE, n) < 0)
+			return NULL;
+	}
+	blob = (struct KdbgBlob *) packed;
+	if (lzss_decode(idx, blob->size, (uint8_t *) (blob + 1), blob->packed) < 0
+	    || ((struct KdbgIndex *) idx)->magic != KDBGIDX_MAGIC
+	    || ((struct KdbgIndex *) idx)->size != blob->size)
+		return NULL;
+	kdbgidx_loaded = blob->size;
+	return (const struct KdbgIndex *) idx;
+}
+
+// Return the debug index (see kern/kdbgidx.h), or null if there is
+// none.  A kernel built with KDBGDISK=1 has no index linked in; it is
+// read from disk on the first lookup instead.
+static const struct KdbgIndex *
+kdbgidx(void)
+{
+	static const struct KdbgIndex *idx;
+	static bool tried;
+
+	if (tried)
+		return idx;
+	tried = 1;
+	idx = (const struct KdbgIndex *) __KDBGIDX_BEGIN__;
+	if (__KDBGIDX_END__ - __KDBGIDX_BEGIN__ >= sizeof(*idx)
+	    && idx->magic == KDBGIDX_MAGIC
+	    && idx->size <= __KDBGIDX_END__ - __KDBGIDX_BEGIN__)
+		return idx;
+	return idx = kdbgidx_load();
+}
+
+// Return the number of bytes of debug index read from disk so far.
+size_t
+debuginfo_loaded(void)
+{
+	return kdbgidx_loaded;
+}
+
+// Fill in 'info' for 'addr' from the debug index: a binary search over
+// the sorted region start addresses, then a walk of that region's line
+// program.
+static int
+kdbgidx_lookup(const struct KdbgIndex *idx, uintptr_t addr,
+	       struct Eipdebuginfo *info)
+{
+	const uint32_t *start = (const uint32_t *) (idx + 1);
+	const struct KdbgFunc *f;
+	const char *str = (const char *) idx + idx->strtab;
+	const uint8_t *p;
+	uint32_t l, r, m, op, v, pc;
+	int line = 0, found = 0;
+
+	// Find the last region that starts at or before 'addr'.
+	l = 0;
+	r = idx->nfunc;
+	while (l < r) {
+		m = (l + r) / 2;
+		if (start[m] <= addr)
+			l = m + 1;
+		else
+			r = m;
+	}
+	if (l == 0)
+		return -1;
+	f = (const struct KdbgFunc *) ((const char *) idx + idx->func) + l - 1;
+	if (addr >= f->end)
+		return -1;
+
+	info->eip_file = str + f->file;
+	if (f->name) {
+		info->eip_fn_name = str + f->name;
+		info->eip_fn_namelen = f->namelen;
+		info->eip_fn_addr = start[l - 1];
+		info->eip_fn_narg = f->narg;
+	}
+
+	p = (const uint8_t *) idx + idx->lines + f->lines;
+	for (pc = start[l - 1]; ; ) {
+		op = uleb128(&p);
+		if (op & 1) {
+			v = uleb128(&p);
+			if (v == 0)
+				break;
+		} else
+			v = sleb128(&p);
+		pc += op >> 1;
+		if (pc > addr)
+			break;
+		if (op & 1)
+			info->eip_file = str + v;
+		else {
+			line += (int32_t) v;
+			found = 1;
+		}
+	}
+	info->eip_line = line;
+	return found ? 0 : -1;
+}
+
+
+// Direct-mapped cache of debuginfo_eip results.  Profiles and repeated
+// backtraces resolve the same few hundred addresses over and over.
+#define SYMCACHE_SIZE	512	// entries; must be a power of 2
+
+static struct {
+	struct {
+		uintptr_t addr;		// 0 if the entry is empty
+		int r;
+		struct Eipdebuginfo info;
+	} ent[SYMCACHE_SIZE];
+} symcache;
+
+// Counted per CPU, so that lookups on different CPUs do not fight
+// over the counters' cache line.
+static DEFINE_PERCPU(uint64_t, symcache_hits);
+static DEFINE_PERCPU(uint64_t, symcache_misses);
+
+// Look up 'addr' in the debug index or, failing that, in the stabs.
+// debuginfo_eip fronts this with a cache.
 int
-debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
+debuginfo_lookup(uintptr_t addr, struct Eipdebuginfo *info)
 {
+	const struct KdbgIndex *idx;
 	const struct Stab *stabs, *stab_end;
 	const char *stabstr, *stabstr_end;
 	int lfile, rfile, lfun, rfun, lline, rline;
@@ -116,6 +331,10 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 	info->eip_fn_addr = addr;
 	info->eip_fn_narg = 0;
 
+	// Use the precomputed index if the kernel has one.
+	if (addr >= ULIM && (idx = kdbgidx()) != NULL)
+		return kdbgidx_lookup(idx, addr, info);
+
 	// Find the relevant set of stabs
 	if (addr >= ULIM) {
 		stabs = __STAB_BEGIN__;
@@ -173,12 +392,10 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 	// Search within [lline, rline] for the line number stab.
 	// If found, set info->eip_line to the right line number.
 	// If not found, return -1.
-	//
-	// Hint:
-	//	There's a particular stabs type used for line numbers.
-	//	Look at the STABS documentation and <inc/stab.h> to find
-	//	which one.
-	// Your code here.
+	stab_binsearch(stabs, &lline, &rline, N_SLINE, addr);
+	if (lline > rline)
+		return -1;
+	info->eip_line = stabs[lline].n_desc;
 
 
 	// Search backwards from the line number for the relevant filename
@@ -204,3 +421,56 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 
 	return 0;
 }
+
+
+// debuginfo_eip(addr, info)
+//
+//	Fill in the 'info' structure with information about the specified
+//	instruction address, 'addr'.  Returns 0 if information was found, and
+//	negative if not.  But even if it returns negative it has stored some
+//	information into '*info'.
+//
+int
+debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
+{
+	uint32_t h = (addr ^ (addr >> 9)) & (SYMCACHE_SIZE - 1);
+
+	if (addr < ULIM)
+		return debuginfo_lookup(addr, info);
+	if (symcache.ent[h].addr == addr) {
+		this_cpu_inc(symcache_hits);
+		*info = symcache.ent[h].info;
+		return symcache.ent[h].r;
+	}
+	this_cpu_inc(symcache_misses);
+	symcache.ent[h].r = debuginfo_lookup(addr, info);
+	symcache.ent[h].info = *info;
+	symcache.ent[h].addr = addr;
+	return symcache.ent[h].r;
+}
+
+// Print the symbolization cache's hit and miss counts and occupancy.
+// With 'clear', empty the cache and reset the counts.
+void
+debuginfo_cache_stats(bool clear)
+{
+	uint64_t hits = 0, misses = 0;
+	int i, used = 0;
+
+	for (i = 0; i < SYMCACHE_SIZE; i++)
+		if (symcache.ent[i].addr)
+			used++;
+	for (i = 0; i < ncpu; i++) {
+		hits += *per_cpu_ptr(&symcache_hits, i);
+		misses += *per_cpu_ptr(&symcache_misses, i);
+	}
+	cprintf("symcache: %llu hits, %llu misses, %d/%d entries used\n",
+		hits, misses, used, SYMCACHE_SIZE);
+	if (clear) {
+		memset(&symcache, 0, sizeof(symcache));
+		for (i = 0; i < ncpu; i++) {
+			*per_cpu_ptr(&symcache_hits, i) = 0;
+			*per_cpu_ptr(&symcache_misses, i) = 0;
+		}
+	}
+}
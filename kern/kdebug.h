@@ -16,5 +16,8 @@ struct Eipdebuginfo {
 };
 
 int debuginfo_eip(uintptr_t eip, struct Eipdebuginfo *info);
+int debuginfo_lookup(uintptr_t eip, struct Eipdebuginfo *info);
+size_t debuginfo_loaded(void);
+void debuginfo_cache_stats(bool clear);
 
 #endif
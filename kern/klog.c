@@ -0,0 +1,190 @@
+// In-memory kernel log.
+//
+// cprintf appends its output to a ring of timestamped records at memory
+// speed instead of waiting on the console devices.  The records are
+// pushed to the console later by klog_drain, which runs whenever the
+// kernel is about to wait for input, before any direct console output,
+// on panic, and whenever the undrained backlog grows past half the ring.
+// When the ring fills, the oldest records are overwritten; the 'dmesg'
+// monitor command shows whatever is still retained.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/console.h>
+#include <kern/klog.h>
+
+#define KLOG_PAD	0x1	// filler up to the end of the ring
+
+// Record header.  Records are 4-byte aligned and never wrap around the
+// end of the ring; when a record does not fit, the rest of the ring is
+// skipped (with a KLOG_PAD record if a header still fits there).
+struct KlogRec {
+	uint32_t seq;		// sequence number
+	uint64_t tsc;		// time stamp counter when logged
+	uint16_t len;		// bytes of text following the header
+	uint16_t flags;
+};
+
+#define RECSIZE(len)	ROUNDUP(sizeof(struct KlogRec) + (len), 4)
+#define MAXREC		(KLOG_SIZE / 4)
+
+// The ring positions are free-running byte offsets; reduce them
+// modulo KLOG_SIZE to index buf.  head <= drain <= tail.
+static struct {
+	uint8_t buf[KLOG_SIZE] __attribute__((aligned(4)));
+	uint32_t head;		// oldest retained record
+	uint32_t drain;		// next record to push to the console
+	uint32_t tail;		// where the next record goes
+	uint32_t seq;		// sequence number of the next record
+	uint32_t clear_seq;	// records before this are hidden from dmesg
+	uint32_t lost;		// records overwritten before being drained
+	bool draining;
+} klog;
+
+static struct KlogRec *
+klog_rec(uint32_t pos)
+{
+	return (struct KlogRec *) &klog.buf[pos % KLOG_SIZE];
+}
+
+// Return the position of the record at 'pos', skipping the ring's end.
+static uint32_t
+klog_skip_end(uint32_t pos)
+{
+	uint32_t left = KLOG_SIZE - pos % KLOG_SIZE;
+
+	if (left < sizeof(struct KlogRec)
+	    || (klog_rec(pos)->flags & KLOG_PAD))
+		return pos + left;
+	return pos;
+}
+
+// Discard the oldest record.
+static void
+klog_drop_head(void)
+{
+	uint32_t next;
+
+	next = klog_skip_end(klog.head);
+	if (next == klog.head) {
+		next += RECSIZE(klog_rec(next)->len);
+		if (klog.drain == klog.head)
+			klog.lost++;	// it never made it to the console
+	}
+	if (klog.drain - klog.head < next - klog.head)
+		klog.drain = next;
+	klog.head = next;
+}
+
+// Append 'n' bytes of text as one record.
+void
+klog_write(const char *s, size_t n)
+{
+	struct KlogRec *r;
+	uint32_t left, size;
+
+	while (n > MAXREC) {
+		klog_write(s, MAXREC);
+		s += MAXREC;
+		n -= MAXREC;
+	}
+	if (n == 0)
+		return;
+
+	size = RECSIZE(n);
+	left = KLOG_SIZE - klog.tail % KLOG_SIZE;
+	if (left < size) {
+		while (klog.tail + left - klog.head > KLOG_SIZE)
+			klog_drop_head();
+		if (left >= sizeof(struct KlogRec)) {
+			r = klog_rec(klog.tail);
+			r->len = left - sizeof(struct KlogRec);
+			r->flags = KLOG_PAD;
+		}
+		klog.tail += left;
+	}
+	while (klog.tail + size - klog.head > KLOG_SIZE)
+		klog_drop_head();
+
+	r = klog_rec(klog.tail);
+	r->seq = klog.seq++;
+	r->tsc = read_tsc();
+	r->len = n;
+	r->flags = 0;
+	memmove(r + 1, s, n);
+	klog.tail += size;
+
+	if (klog.tail - klog.drain > KLOG_SIZE / 2)
+		klog_drain();
+}
+
+// Push all undrained records to the console devices.
+void
+klog_drain(void)
+{
+	struct KlogRec *r;
+	uint32_t pos;
+
+	if (klog.draining || !cons_ready())
+		return;
+	klog.draining = 1;
+	if (klog.lost) {
+		cons_write("\n[klog: output lost]\n", 21);
+		klog.lost = 0;
+	}
+	while (klog.drain != klog.tail) {
+		pos = klog_skip_end(klog.drain);
+		if (pos == klog.tail) {
+			klog.drain = pos;
+			break;
+		}
+		r = klog_rec(pos);
+		klog.drain = pos + RECSIZE(r->len);
+		cons_write((const char *) (r + 1), r->len);
+	}
+	klog.draining = 0;
+}
+
+// Print the retained log straight to the console, prefixing each line
+// with the sequence number and time stamp of the record that started it.
+// With 'clear', hide the printed records from later dumps.
+void
+klog_dump(bool clear)
+{
+	struct KlogRec *r;
+	uint32_t pos;
+	const char *p, *q, *e;
+	char prefix[32];
+	bool bol = 1;
+
+	klog_drain();
+	for (pos = klog.head; pos != klog.tail; ) {
+		pos = klog_skip_end(pos);
+		if (pos == klog.tail)
+			break;
+		r = klog_rec(pos);
+		pos += RECSIZE(r->len);
+		if ((int32_t) (r->seq - klog.clear_seq) < 0)
+			continue;
+		p = (const char *) (r + 1);
+		e = p + r->len;
+		while (p < e) {
+			if (bol)
+				cons_write(prefix, snprintf(prefix, sizeof(prefix),
+						"[%5u %16llu] ", r->seq, r->tsc));
+			for (q = p; q < e && *q != '\n'; q++)
+				/* do nothing */;
+			bol = (q < e);
+			if (bol)
+				q++;
+			cons_write(p, q - p);
+			p = q;
+		}
+	}
+	if (!bol)
+		cons_write("\n", 1);
+	if (clear)
+		klog.clear_seq = klog.seq;
+}
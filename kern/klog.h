@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_KLOG_H
+#define JOS_KERN_KLOG_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Size of the in-memory kernel log, in bytes.  Must be a power of 2.
+#define KLOG_SIZE	(64 * 1024)
+
+void klog_write(const char *s, size_t n);
+void klog_drain(void);
+void klog_dump(bool clear);
+
+#endif	// !JOS_KERN_KLOG_H
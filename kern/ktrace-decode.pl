@@ -0,0 +1,108 @@
+#!/usr/bin/perl
+#
+# Usage: kern/ktrace-decode.pl obj/kern/kernel [console-log]
+#
+# Format the binary trace printed by the kernel monitor's 'ktrace dump'
+# command.  The events only record the offset of their format string in
+# the kernel's .ktrace_fmt section, so the strings are read back out of
+# the kernel image that produced the trace.  Lines of the console log
+# that are not trace events are ignored.  Output is one line per event,
+# in the order the kernel printed them, which is time order across CPUs:
+#
+#	<cycles since first event>  <cpu>  <formatted message>
+
+use strict;
+
+@ARGV >= 1 || die "usage: $0 obj/kern/kernel [console-log]\n";
+my $kernel = shift @ARGV;
+
+open(K, $kernel) || die "open $kernel: $!";
+binmode K;
+my $elf = do { local $/; <K> };
+close K;
+
+substr($elf, 0, 4) eq "\x7fELF" || die "$kernel: not an ELF file\n";
+my ($shoff) = unpack("V", substr($elf, 32, 4));
+my ($shentsize, $shnum, $shstrndx) = unpack("v3", substr($elf, 46, 6));
+
+my @sh;
+for (my $i = 0; $i < $shnum; $i++) {
+	my ($name, $type, $flags, $addr, $off, $size) =
+		unpack("V6", substr($elf, $shoff + $i * $shentsize, 24));
+	push @sh, { name => $name, type => $type, addr => $addr,
+		    off => $off, size => $size };
+}
+my $shstr = $sh[$shstrndx];
+for my $s (@sh) {
+	my $n = substr($elf, $shstr->{off} + $s->{name}, 256);
+	$s->{name} = unpack("Z*", $n);
+}
+
+my ($fmtsec) = grep { $_->{name} eq ".ktrace_fmt" } @sh;
+$fmtsec || die "$kernel: no .ktrace_fmt section\n";
+my $fmts = substr($elf, $fmtsec->{off}, $fmtsec->{size});
+
+# Read a NUL-terminated string at kernel virtual address $va, if it
+# falls within a section that has contents in the image.
+sub kstring {
+	my ($va) = @_;
+	for my $s (@sh) {
+		next if $s->{type} != 1 || !$s->{addr};	# SHT_PROGBITS
+		if ($va >= $s->{addr} && $va < $s->{addr} + $s->{size}) {
+			my $o = $s->{off} + $va - $s->{addr};
+			return unpack("Z*", substr($elf, $o, 1024));
+		}
+	}
+	return sprintf("<%08x>", $va);
+}
+
+# Format one event the way the kernel's printfmt would.
+sub fmt_event {
+	my ($fmt, @args) = @_;
+	my $out = "";
+
+	while ($fmt =~ /\G([^%]*)%([-0#]*)(\d*|\*)(?:\.(\d*))?(l*)(.)/gc) {
+		my ($lit, $flags, $width, $prec, $l, $conv) =
+			($1, $2, $3, $4, $5, $6);
+		$out .= $lit;
+		$width = shift @args if $width eq "*";
+		my $spec = "%" . $flags . $width . (defined $prec ? ".$prec" : "");
+		if ($conv eq "%") {
+			$out .= "%";
+			next;
+		}
+		my $v = shift(@args) // 0;
+		if (length($l) >= 2) {
+			$v += (shift(@args) // 0) * 4294967296;
+		}
+		if ($conv eq "d") {
+			$v -= 4294967296 if length($l) < 2 && $v >= 2147483648;
+			$out .= sprintf($spec . "d", $v);
+		} elsif ($conv =~ /[uxo]/) {
+			$out .= sprintf($spec . $conv, $v);
+		} elsif ($conv eq "p") {
+			$out .= sprintf("0x%08x", $v);
+		} elsif ($conv eq "c") {
+			$out .= sprintf($spec . "c", $v);
+		} elsif ($conv eq "s") {
+			$out .= sprintf($spec . "s", kstring($v));
+		} elsif ($conv eq "e") {
+			$out .= sprintf("error %d", $v >= 2147483648 ? 4294967296 - $v : $v);
+		} else {
+			$out .= "%$conv";
+		}
+	}
+	$fmt =~ /\G(.*)/s;
+	return $out . $1;
+}
+
+my $t0;
+while (<>) {
+	next unless /^ktrace ([0-9a-f]{16}) ([0-9a-f]+) ([0-9a-f]+)((?: [0-9a-f]+)*)\s*$/;
+	my ($tsc, $cpu, $id, @args) =
+		(hex($1), hex($2), hex($3), map { hex } split(' ', $4));
+	my $fmt = unpack("Z*", substr($fmts, $id, 1024));
+	$fmt =~ s/\n$//;
+	$t0 //= $tsc;
+	printf("%12d  %2d  %s\n", $tsc - $t0, $cpu, fmt_event($fmt, @args));
+}
@@ -0,0 +1,86 @@
+// Deferred-formatting binary event trace; see kern/ktrace.h.
+
+#include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/ktrace.h>
+#include <kern/kclock.h>
+#include <kern/cpu.h>
+#include <kern/percpu.h>
+
+extern const char __KTRACE_FMT_BEGIN__[];	// Beginning of format strings
+
+bool ktrace_enabled;
+
+// Each CPU records into its own ring, which keeps that CPU's most
+// recent KTRACE_NEVENTS events, so CPUs neither contend for a slot nor
+// share cache lines.  The rings are too big for the per-CPU area, so
+// only their heads live there.
+static DEFINE_PERCPU(uint32_t, ktrace_head);	// events recorded
+static struct KtraceEvent ktrace_ev[NCPU][KTRACE_NEVENTS];
+
+void
+ktrace_record(const char *fmt, const uint32_t *args, int nargs)
+{
+	struct KtraceEvent *e;
+	uint32_t i;
+
+	// Claim a slot atomically: an interrupt handler may trace
+	// while we are in the middle of recording.
+	i = __atomic_fetch_add(this_cpu_ptr(&ktrace_head), 1, __ATOMIC_RELAXED);
+	e = &ktrace_ev[cpunum()][i % KTRACE_NEVENTS];
+	e->tsc = clock_tsc();
+	e->fmt = fmt - __KTRACE_FMT_BEGIN__;
+	e->nargs = nargs;
+	for (i = 0; i < nargs; i++)
+		e->args[i] = args[i];
+}
+
+// Print the retained events of all CPUs, merged oldest first, one per
+// line:
+//	ktrace <tsc> <cpu> <fmt> <arg>...
+// with every field in hex.  The time stamps come from clock_tsc, which
+// corrects for each CPU's TSC offset, so they order events across CPUs.
+// kern/ktrace-decode.pl formats the output.
+void
+ktrace_dump(void)
+{
+	uint32_t next[NCPU], head[NCPU], j;
+	struct KtraceEvent *e, *best;
+	int cpu, bestcpu;
+
+	for (cpu = 0; cpu < ncpu; cpu++) {
+		head[cpu] = *per_cpu_ptr(&ktrace_head, cpu);
+		next[cpu] = head[cpu] > KTRACE_NEVENTS
+			? head[cpu] - KTRACE_NEVENTS : 0;
+	}
+	for (;;) {
+		best = NULL;
+		bestcpu = 0;
+		for (cpu = 0; cpu < ncpu; cpu++) {
+			if (next[cpu] == head[cpu])
+				continue;
+			e = &ktrace_ev[cpu][next[cpu] % KTRACE_NEVENTS];
+			if (!best || e->tsc < best->tsc) {
+				best = e;
+				bestcpu = cpu;
+			}
+		}
+		if (!best)
+			break;
+		next[bestcpu]++;
+		cprintf("ktrace %016llx %x %x", best->tsc, bestcpu, best->fmt);
+		for (j = 0; j < best->nargs && j < KTRACE_MAXARGS; j++)
+			cprintf(" %x", best->args[j]);
+		cprintf("\n");
+	}
+}
+
+void
+ktrace_clear(void)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < ncpu; cpu++)
+		*per_cpu_ptr(&ktrace_head, cpu) = 0;
+}
@@ -0,0 +1,51 @@
+#ifndef JOS_KERN_KTRACE_H
+#define JOS_KERN_KTRACE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Binary event tracing with deferred formatting.
+//
+// KTRACE(fmt, args...) records only a time stamp, the identity of its
+// format string and up to KTRACE_MAXARGS raw 32-bit argument words,
+// in the running CPU's own ring.
+// Nothing is formatted in the kernel: the format strings are collected
+// in the .ktrace_fmt section of obj/kern/kernel, and 'ktrace dump'
+// prints the events as hex for kern/ktrace-decode.pl to format on the
+// host.  Every argument is one word, so pass 64-bit values as two
+// arguments (low word first) and formats such as %llx consume two.
+//
+//	KTRACE("irq %d at eip %08x", irq, tf->tf_eip);
+
+#define KTRACE_MAXARGS	4
+#define KTRACE_NEVENTS	2048	// per CPU; must be a power of 2
+
+struct KtraceEvent {
+	uint64_t tsc;			// clock_tsc(): comparable across CPUs
+	uint16_t fmt;			// offset of format in .ktrace_fmt
+	uint16_t nargs;
+	uint32_t args[KTRACE_MAXARGS];
+};
+
+extern bool ktrace_enabled;
+
+#define KTRACE(fmt, ...)						\
+do {									\
+	static const char __ktrace_fmt[]				\
+		__attribute__((section(".ktrace_fmt"), aligned(1))) = fmt; \
+	if (ktrace_enabled) {						\
+		uint32_t __ktrace_args[] = { 0, ##__VA_ARGS__ };	\
+		(void) sizeof(char[ARRAY_SIZE(__ktrace_args) - 1	\
+				   <= KTRACE_MAXARGS ? 1 : -1]);	\
+		ktrace_record(__ktrace_fmt, __ktrace_args + 1,		\
+			      ARRAY_SIZE(__ktrace_args) - 1);		\
+	}								\
+} while (0)
+
+void ktrace_record(const char *fmt, const uint32_t *args, int nargs);
+void ktrace_dump(void);
+void ktrace_clear(void);
+
+#endif	// !JOS_KERN_KTRACE_H
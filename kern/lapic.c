@@ -0,0 +1,398 @@
+// The local APIC manages internal (non-I/O) interrupts.
+// See Chapter 10 of the Intel 64 and IA-32 Architectures Software
+// Developer's Manual, Volume 3A.
+//
+// The kernel uses the LAPIC for its timer and, once ioapic_init has
+// taken over from the 8259A, for all device interrupts.  Until then
+// the 8259A reaches the CPU through LINT0 in virtual-wire mode, which
+// the BIOS sets up and lapic_init leaves alone.
+//
+// When the CPU supports it, the LAPIC runs in x2APIC mode, where its
+// registers are MSRs: an EOI is then one wrmsr instead of an
+// uncached MMIO write.
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/trap.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/kclock.h>
+#include <kern/ioapic.h>
+#include <kern/percpu.h>
+
+// Local APIC registers, divided by 4 for use as uint32_t[] indices.
+#define ID      (0x0020/4)   // ID
+#define VER     (0x0030/4)   // Version
+#define TPR     (0x0080/4)   // Task Priority
+#define EOI     (0x00B0/4)   // EOI
+#define SVR     (0x00F0/4)   // Spurious Interrupt Vector
+	#define ENABLE     0x00000100   // Unit Enable
+#define ESR     (0x0280/4)   // Error Status
+#define ICRLO   (0x0300/4)   // Interrupt Command
+	#define INIT       0x00000500   // INIT/RESET
+	#define STARTUP    0x00000600   // Startup IPI
+	#define DELIVS     0x00001000   // Delivery status
+	#define ASSERT     0x00004000   // Assert interrupt (vs deassert)
+	#define DEASSERT   0x00000000
+	#define LEVEL      0x00008000   // Level triggered
+	#define BCAST      0x00080000   // Send to all APICs, including self.
+	#define OTHERS     0x000C0000   // Send to all APICs, excluding self.
+	#define BUSY       0x00001000
+	#define FIXED      0x00000000
+	#define NMI        0x00000400   // Deliver as an NMI
+#define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
+#define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
+	#define ONESHOT    0x00000000   // One-shot count
+	#define PERIODIC   0x00020000   // Periodic
+	#define TSCDEADLINE 0x00040000  // Fire when the TSC passes IA32_TSC_DEADLINE
+#define PCINT   (0x0340/4)   // Performance Counter LVT
+#define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
+#define ERROR   (0x0370/4)   // Local Vector Table 3 (ERROR)
+	#define MASKED     0x00010000   // Interrupt masked
+#define TICR    (0x0380/4)   // Timer Initial Count
+#define TCCR    (0x0390/4)   // Timer Current Count
+#define TDCR    (0x03E0/4)   // Timer Divide Configuration
+	#define X16        0x00000003   // divide counts by 16
+
+// Model-specific registers
+#define MSR_APICBASE	0x1B
+	#define APICBASE_EN	0x00000800	// APIC globally enabled
+	#define APICBASE_EXTD	0x00000400	// x2APIC mode
+#define MSR_X2APIC	0x800	// x2APIC register 'index' is MSR_X2APIC + index/4
+#define MSR_TSC_DEADLINE	0x6E0
+
+// MSI address and data [SDM 10.11]
+#define MSI_ADDR	0xFEE00000	// plus the destination APIC ID << 12
+#define MSI_DEST_SHIFT	12
+
+#define CALIBRATE_MS	10	// length of the timer calibration
+
+physaddr_t lapicaddr;        // Initialized in lapic_init
+volatile uint32_t *lapic;
+bool lapic_x2apic;
+uint32_t lapic_timer_khz;
+
+static bool use_deadline;
+
+static void
+lapicw(int index, int value)
+{
+	if (lapic_x2apic) {
+		wrmsr(MSR_X2APIC + index / 4, value);
+		return;
+	}
+	lapic[index] = value;
+	lapic[ID];  // wait for write to finish, by reading
+}
+
+static uint32_t
+lapicr(int index)
+{
+	if (lapic_x2apic)
+		return rdmsr(MSR_X2APIC + index / 4);
+	return lapic[index];
+}
+
+// The LAPIC ID of this CPU.  In xAPIC mode it is in bits 31-24.
+static uint32_t
+lapic_id(void)
+{
+	return lapic_x2apic ? lapicr(ID) : lapicr(ID) >> 24;
+}
+
+// Measure the LAPIC timer's rate against the TSC: count down from the
+// top for CALIBRATE_MS and see how far the count got.
+static void
+lapic_timer_calibrate(void)
+{
+	uint64_t start;
+
+	lapicw(TIMER, MASKED | ONESHOT | (IRQ_OFFSET + IRQ_LTIMER));
+	lapicw(TICR, 0xFFFFFFFF);
+	start = read_tsc();
+	while (read_tsc() - start < (uint64_t) tsc_khz * CALIBRATE_MS)
+		/* do nothing */;
+	lapic_timer_khz = (0xFFFFFFFF - lapicr(TCCR)) / CALIBRATE_MS;
+	lapicw(TICR, 0);
+}
+
+void
+lapic_init(void)
+{
+	uint64_t base;
+
+	if (!lapic) {
+		// First call, on the boot CPU: find the LAPIC.
+		if (!cpufeat.apic)
+			return;
+		base = rdmsr(MSR_APICBASE);
+		if (!(base & APICBASE_EN))
+			return;
+		lapicaddr = base & ~(uint64_t) (PGSIZE - 1);
+
+		// lapicaddr is the physical address of the LAPIC's 4K MMIO
+		// region.  Map it in to virtual memory so we can access it.
+		// In x2APIC mode the mapping is unused, but lapic != NULL
+		// still says that there is a LAPIC.
+		lapic = mmio_map_region(lapicaddr, 4096);
+		lapic_x2apic = cpufeat.x2apic;
+	}
+	// Every CPU switches its own LAPIC to x2APIC mode.
+	if (lapic_x2apic)
+		wrmsr(MSR_APICBASE, rdmsr(MSR_APICBASE) | APICBASE_EXTD);
+
+	// Enable local APIC; set spurious interrupt vector.
+	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
+
+	// The timer stays masked until a timer is armed.
+	lapicw(TDCR, X16);
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_LTIMER));
+
+	// Leave LINT0 of the BSP enabled so that it can get
+	// interrupts from the 8259A chip until the I/O APIC takes over.
+	//
+	// According to Intel MP Specification, the BIOS should initialize
+	// BSP's local APIC in Virtual Wire Mode, in which 8259A's
+	// INTR is virtually connected to BSP's LINTIN0. In this mode,
+	// we do not need to program the IOAPIC.
+	if (thiscpu != bootcpu || ioapic_active)
+		lapicw(LINT0, MASKED);
+
+	// Disable performance counter overflow interrupts
+	// on machines that provide that interrupt entry.
+	if (((lapicr(VER)>>16) & 0xFF) >= 4)
+		lapicw(PCINT, MASKED);
+
+	// Errors are only counted in ESR, not delivered.
+	lapicw(ERROR, MASKED | (IRQ_OFFSET + IRQ_ERROR));
+
+	// Clear error status register (requires back-to-back writes).
+	lapicw(ESR, 0);
+	lapicw(ESR, 0);
+
+	// Ack any outstanding interrupts.
+	lapicw(EOI, 0);
+
+	// Enable interrupts on the APIC (but not on the processor).
+	lapicw(TPR, 0);
+
+	// The timer counts in TSC-deadline mode if the CPU has it.
+	// Otherwise it counts down bus clocks, whose rate the boot CPU
+	// measures for all of them.
+	if (thiscpu != bootcpu || tsc_khz == 0)
+		return;
+	if (cpufeat.tscdeadline)
+		use_deadline = 1;
+	else
+		lapic_timer_calibrate();
+}
+
+void
+lapic_print(void)
+{
+	if (!lapic) {
+		cprintf("LAPIC: none\n");
+		return;
+	}
+	cprintf("LAPIC: %s at %08x, id %u, version 0x%x, timer ",
+		lapic_x2apic ? "x2APIC" : "xAPIC", lapicaddr, lapic_id(),
+		lapicr(VER) & 0xFF);
+	if (use_deadline)
+		cprintf("TSC-deadline\n");
+	else if (lapic_timer_khz)
+		cprintf("one-shot, %u kHz\n", lapic_timer_khz);
+	else
+		cprintf("unusable\n");
+}
+
+// Return the index in cpus[] of the CPU running this code.
+// Once the CPU has loaded its per-CPU segment this is one load;
+// before that, look up the LAPIC ID.
+int
+cpunum(void)
+{
+	uint32_t id;
+	int i;
+
+	if ((i = this_cpu_read(cpu_number)) >= 0)
+		return i;
+	if (!lapic)
+		return bootcpu ? bootcpu->cpu_id : 0;
+	id = lapic_id();
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_apicid == id)
+			return i;
+	return 0;
+}
+
+// Acknowledge interrupt.
+void
+lapic_eoi(void)
+{
+	if (lapic_x2apic)
+		wrmsr(MSR_X2APIC + EOI / 4, 0);
+	else if (lapic)
+		lapic[EOI] = 0;
+}
+
+// Spin for a given number of microseconds, timed with the TSC.
+static void
+microdelay(int us)
+{
+	uint64_t start = read_tsc();
+
+	if (tsc_khz == 0) {
+		// Each read of the POST port takes about a microsecond.
+		while (us-- > 0)
+			inb(0x80);
+		return;
+	}
+	while (read_tsc() - start < (uint64_t) us * tsc_khz / 1000)
+		asm volatile("pause");
+}
+
+// Send an interprocessor interrupt: 'lo' is the low word of the ICR,
+// 'apicid' the destination (ignored by the shorthands).
+static void
+lapic_icr(uint32_t apicid, uint32_t lo)
+{
+	if (lapic_x2apic) {
+		wrmsr(MSR_X2APIC + ICRLO / 4, (uint64_t) apicid << 32 | lo);
+		return;
+	}
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, lo);
+	while (lapicr(ICRLO) & DELIVS)
+		;
+}
+
+// Start additional processor running entry code at addr.
+// See Appendix B of MultiProcessor Specification.
+void
+lapic_startap(uint32_t apicid, uint32_t addr)
+{
+	int i;
+	uint16_t *wrv;
+
+	// "The BSP must initialize CMOS shutdown code to 0AH
+	// and the warm reset vector (DWORD based at 40:67) to point at
+	// the AP startup code prior to the [universal startup algorithm]."
+	outb(IO_RTC, 0xF);  // offset 0xF is shutdown code
+	outb(IO_RTC+1, 0x0A);
+	wrv = (uint16_t *)KADDR((0x40 << 4 | 0x67));  // Warm reset vector
+	wrv[0] = 0;
+	wrv[1] = addr >> 4;
+
+	// "Universal startup algorithm."
+	// Send INIT (level-triggered) interrupt to reset other CPU.
+	lapic_icr(apicid, INIT | LEVEL | ASSERT);
+	microdelay(200);
+	lapic_icr(apicid, INIT | LEVEL);
+	microdelay(10000);
+
+	// Send startup IPI (twice!) to enter code.
+	// Regular hardware is supposed to only accept a STARTUP
+	// when it is in the halted state due to an INIT.  So the second
+	// should be ignored, but it is part of the official Intel algorithm.
+	for (i = 0; i < 2; i++) {
+		lapic_icr(apicid, STARTUP | (addr >> 12));
+		microdelay(200);
+	}
+}
+
+// Send interrupt 'vector' to CPU 'cpu'.
+void
+lapic_ipi(int cpu, int vector)
+{
+	if (lapic)
+		lapic_icr(cpus[cpu].cpu_apicid, FIXED | vector);
+}
+
+// Send an NMI to CPU 'cpu'.  This may run in an NMI handler that has
+// interrupted lapic_icr between its writes to ICRHI and ICRLO, so it
+// waits for any IPI in flight and puts ICRHI back afterwards.
+void
+lapic_nmi(int cpu)
+{
+	uint32_t hi;
+
+	if (!lapic)
+		return;
+	if (lapic_x2apic) {
+		lapic_icr(cpus[cpu].cpu_apicid, NMI);
+		return;
+	}
+	while (lapicr(ICRLO) & DELIVS)
+		;
+	hi = lapicr(ICRHI);
+	lapic_icr(cpus[cpu].cpu_apicid, NMI);
+	lapicw(ICRHI, hi);
+}
+
+// Stop taking interrupts from the 8259A through LINT0.  Called when
+// the I/O APIC takes over.
+void
+lapic_maskpic(void)
+{
+	if (lapic)
+		lapicw(LINT0, MASKED);
+}
+
+// Compose the address and data words of a message-signalled interrupt
+// that delivers 'vector' to CPU 'cpu', fixed and edge triggered.  A
+// PCI driver writes them to the device's MSI capability.
+void
+msi_compose(int cpu, int vector, uint32_t *addr, uint32_t *data)
+{
+	*addr = MSI_ADDR | (cpus[cpu].cpu_apicid << MSI_DEST_SHIFT);
+	*data = vector;
+}
+
+// Return whether lapic_timer_arm can be used.
+bool
+lapic_timer_ok(void)
+{
+	return lapic && (use_deadline || lapic_timer_khz);
+}
+
+// Interrupt once, at IRQ_OFFSET+IRQ_LTIMER, about 'cycles' TSC cycles
+// from now.  Replaces any earlier setting.
+void
+lapic_timer_arm(uint64_t cycles)
+{
+	uint64_t count;
+
+	if (use_deadline) {
+		// The mode switch must come before the MSR write, which
+		// is ignored in other modes.
+		lapicw(TIMER, TSCDEADLINE | (IRQ_OFFSET + IRQ_LTIMER));
+		wrmsr(MSR_TSC_DEADLINE, read_tsc() + cycles);
+		return;
+	}
+	if (cycles > (1ULL << 40))
+		cycles = 1ULL << 40;	// keep the product below in 64 bits
+	count = cycles * lapic_timer_khz / tsc_khz;
+	if (count == 0)
+		count = 1;
+	else if (count > 0xFFFFFFFF)
+		count = 0xFFFFFFFF;
+	lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_LTIMER));
+	lapicw(TICR, count);
+}
+
+// Cancel any pending timer interrupt.
+void
+lapic_timer_stop(void)
+{
+	if (!lapic)
+		return;
+	if (use_deadline)
+		wrmsr(MSR_TSC_DEADLINE, 0);
+	else
+		lapicw(TICR, 0);
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_LTIMER));
+}
@@ -0,0 +1,229 @@
+#!/usr/bin/perl
+#
+# Usage: kern/mkdbgidx.pl [-z] obj/kern/kernel.noidx obj/kern/kdbgidx.bin
+#
+# Build the address-to-line index searched by debuginfo_eip (see
+# kern/kdbgidx.h) from the stabs of a linked kernel.  The kernel is
+# then linked a second time with the index as its .kdbgidx section;
+# the index is placed after the text and the stabs, so the addresses
+# recorded here do not change.
+#
+# With -z, write the index LZSS-compressed behind a KdbgBlob header
+# instead, for a kernel that reads it from disk.
+
+use strict;
+
+my $compress = @ARGV && $ARGV[0] eq "-z" && shift @ARGV;
+@ARGV == 2 || die "usage: $0 [-z] kernel index.bin\n";
+my ($kernel, $out) = @ARGV;
+
+use constant {
+	N_FUN => 0x24, N_SLINE => 0x44, N_SO => 0x64, N_SOL => 0x84,
+	N_PSYM => 0xa0,
+};
+
+open(K, $kernel) || die "open $kernel: $!";
+binmode K;
+my $elf = do { local $/; <K> };
+close K;
+
+substr($elf, 0, 4) eq "\x7fELF" || die "$kernel: not an ELF file\n";
+my ($shoff) = unpack("V", substr($elf, 32, 4));
+my ($shentsize, $shnum, $shstrndx) = unpack("v3", substr($elf, 46, 6));
+
+my @sh;
+for (my $i = 0; $i < $shnum; $i++) {
+	my ($name, $type, $flags, $addr, $off, $size) =
+		unpack("V6", substr($elf, $shoff + $i * $shentsize, 24));
+	push @sh, { name => $name, type => $type, addr => $addr,
+		    off => $off, size => $size };
+}
+my $shstr = $sh[$shstrndx];
+for my $s (@sh) {
+	$s->{name} = unpack("Z*", substr($elf, $shstr->{off} + $s->{name}, 256));
+}
+my %sec = map { $_->{name} => $_ } @sh;
+$sec{".stab"} && $sec{".stabstr"} || die "$kernel: no stabs\n";
+my $text_end = $sec{".text"}->{addr} + $sec{".text"}->{size};
+my $stabstr = substr($elf, $sec{".stabstr"}->{off}, $sec{".stabstr"}->{size});
+
+# Walk the stabs in order, collecting regions and their line entries.
+my (@regions, $cu, $fn, $file, $params);
+my $stab = $sec{".stab"};
+for (my $o = 0; $o + 12 <= $stab->{size}; $o += 12) {
+	my ($strx, $type, $other, $desc, $value) =
+		unpack("VCCvV", substr($elf, $stab->{off} + $o, 12));
+	my $name = unpack("Z*", substr($stabstr, $strx, 1024));
+
+	$params = 0 if $type != N_PSYM;
+	if ($type == N_SO) {
+		undef $fn;
+		if ($value == 0 || $name eq "") {	# end of a compilation unit
+			undef $cu;
+		} elsif ($name !~ m{/$}) {		# not the directory stab
+			$file = $name;
+			$cu = { start => $value, name => "", file => $file,
+				lines => [], narg => 0 };
+			push @regions, $cu;
+		}
+	} elsif ($type == N_SOL) {
+		$file = $name;
+	} elsif ($type == N_FUN && $name ne "") {
+		$name =~ s/:.*//;
+		$fn = { start => $value, name => $name, file => $file,
+			lines => [], narg => 0 };
+		push @regions, $fn;
+		$cu->{hasfun} = 1 if $cu;
+		$params = 1;
+	} elsif ($type == N_FUN) {			# end of function
+		$fn->{end} = $fn->{start} + $value if $fn;
+		undef $fn;
+	} elsif ($type == N_PSYM) {
+		$fn->{narg}++ if $fn && $params;
+	} elsif ($type == N_SLINE) {
+		# Line addresses are relative to the function in C code
+		# and absolute in assembly code.
+		if ($fn) {
+			push @{$fn->{lines}}, [$fn->{start} + $value, $desc, $file];
+		} elsif ($cu) {
+			push @{$cu->{lines}}, [$value, $desc, $file];
+		}
+	}
+}
+
+# A compilation unit only needs a region of its own if it has no
+# functions, as in assembly files.
+@regions = grep { $_->{name} ne "" || !$_->{hasfun} } @regions;
+@regions = sort { $a->{start} <=> $b->{start} } @regions;
+for (my $i = 0; $i < @regions; $i++) {
+	$regions[$i]->{end} //= $i + 1 < @regions ? $regions[$i + 1]->{start}
+						  : $text_end;
+}
+
+my $strtab = "\0";
+my %stroff;
+sub str {
+	my ($s) = @_;
+	return 0 if $s eq "";
+	if (!exists $stroff{$s}) {
+		$stroff{$s} = length($strtab);
+		$strtab .= $s . "\0";
+	}
+	return $stroff{$s};
+}
+
+sub uleb {
+	my ($v) = @_;
+	my $b = "";
+	do {
+		my $c = $v & 0x7f;
+		$v >>= 7;
+		$b .= chr($v ? $c | 0x80 : $c);
+	} while ($v);
+	return $b;
+}
+
+sub sleb {
+	use integer;	# for an arithmetic right shift
+	my ($v) = @_;
+	my $b = "";
+	while (1) {
+		my $c = $v & 0x7f;
+		$v >>= 7;
+		return $b . chr($c)
+			if ($v == 0 && !($c & 0x40)) || ($v == -1 && ($c & 0x40));
+		$b .= chr($c | 0x80);
+	}
+}
+
+my ($addrs, $funcs, $lines) = ("", "", "");
+for my $r (@regions) {
+	my ($pc, $line, $f) = ($r->{start}, 0, $r->{file});
+	my $i = 0;
+	my @l = map { [@$_, $i++] } @{$r->{lines}};
+	my $prog = "";
+	for my $e (sort { $a->[0] <=> $b->[0] || $a->[3] <=> $b->[3] } @l) {
+		my ($addr, $n, $file) = @$e;
+		next if $addr < $r->{start};
+		if ($file ne $f) {
+			$prog .= uleb(($addr - $pc) << 1 | 1) . uleb(str($file));
+			($pc, $f) = ($addr, $file);
+		}
+		$prog .= uleb(($addr - $pc) << 1) . sleb($n - $line);
+		($pc, $line) = ($addr, $n);
+	}
+	$prog .= uleb(1) . uleb(0);
+
+	$addrs .= pack("V", $r->{start});
+	$funcs .= pack("VVVVvv", $r->{end}, str($r->{name}), str($r->{file}),
+		       length($lines), length($r->{name}), $r->{narg});
+	$lines .= $prog;
+}
+$lines .= "\0" x (-length($lines) & 3);
+$strtab .= "\0" x (-length($strtab) & 3);
+
+my $n = @regions;
+my $hdrsize = 24;
+my $funcoff = $hdrsize + length($addrs);
+my $lineoff = $funcoff + length($funcs);
+my $stroff = $lineoff + length($lines);
+my $size = $stroff + length($strtab);
+
+my $index = pack("V6", 0x5844424B, $n, $funcoff, $lineoff, $stroff, $size)
+	. $addrs . $funcs . $lines . $strtab;
+if ($compress) {
+	my $z = lzss($index);
+	$index = pack("V3", 0x5A44424B, length($index), length($z)) . $z;
+}
+
+open(O, ">$out") || die "create $out: $!";
+binmode O;
+print O $index;
+close O;
+
+# LZSS with a 4096-byte window and matches of 3 to 18 bytes, in the
+# format kern/kdebug.c decodes.  Candidate matches are found through
+# chains of earlier positions with the same first three bytes.
+sub lzss {
+	my ($in) = @_;
+	my $n = length($in);
+	my ($out, $group, $flags, $items) = ("", "", 0, 0);
+	my %chain;
+
+	my $add = sub {
+		my ($i) = @_;
+		return if $i + 3 > $n;
+		my $c = $chain{substr($in, $i, 3)} //= [];
+		push @$c, $i;
+		shift @$c if @$c > 64;
+	};
+
+	for (my $i = 0; $i < $n; ) {
+		my ($len, $dist) = (0, 0);
+		if ($i + 3 <= $n) {
+			for my $j (reverse @{$chain{substr($in, $i, 3)} // []}) {
+				last if $i - $j > 4096;
+				my $l = 3;
+				$l++ while $l < 18 && $i + $l < $n
+				    && substr($in, $j + $l, 1) eq substr($in, $i + $l, 1);
+				($len, $dist) = ($l, $i - $j) if $l > $len;
+				last if $len == 18;
+			}
+		}
+		if ($len >= 3) {
+			$group .= chr(($dist - 1) & 0xff)
+				. chr((($dist - 1) >> 8) << 4 | ($len - 3));
+			$add->($i++) for 1 .. $len;
+		} else {
+			$flags |= 1 << $items;
+			$group .= substr($in, $i, 1);
+			$add->($i++);
+		}
+		if (++$items == 8) {
+			$out .= chr($flags) . $group;
+			($group, $flags, $items) = ("", 0, 0);
+		}
+	}
+	$out .= chr($flags) . $group if $items;
+	return $out;
+}
@@ -10,6 +10,19 @@
 #include <kern/console.h>
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
+#include <kern/klog.h>
+#include <kern/ktrace.h>
+#include <kern/cpu.h>
+#include <kern/prof.h>
+#include <kern/pmu.h>
+#include <kern/bench.h>
+#include <kern/kclock.h>
+#include <kern/timer.h>
+#include <kern/ioapic.h>
+#include <kern/picirq.h>
+#include <kern/trap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -24,8 +37,22 @@ struct Command {
 static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
+	{ "dmesg", "Display the kernel log ('dmesg -c' to clear it)", mon_dmesg },
+	{ "ktrace", "Control binary event tracing (on|off|dump|clear)", mon_ktrace },
+	{ "symcache", "Display symbol cache statistics ('symcache -c' to clear)", mon_symcache },
+	{ "prof", "Sample where the kernel runs (start [hz]|stop|report)", mon_prof },
+	{ "perf", "Count hardware events during a command (perf <cmd> [args])", mon_perf },
+	{ "bench", "Run kernel microbenchmarks (bench [name|all])", mon_bench },
+	{ "cpus", "Display each CPU's state and trap count", mon_cpus },
+	{ "sched", "Show run queues, or time spinning tasks (sched [test <n> <us>])", mon_sched },
+	{ "lockstat", "Show the most contended locks (lockstat [on|off|clear|<n>])", mon_lockstat },
+	{ "irq", "Show interrupt routing, or steer an IRQ (irq [<irq> <cpu>])", mon_irq },
+	{ "sleep", "Wait on a kernel timer (sleep <ms>)", mon_sleep },
+	{ "backtrace", "Display a backtrace of the kernel stack", mon_backtrace },
 };
 
+static int runargs(int argc, char **argv, struct Trapframe *tf);
+
 /***** Implementations of basic kernel monitor commands *****/
 
 int
@@ -51,13 +78,229 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	cprintf("  end    %08x (virt)  %08x (phys)\n", end, end - KERNBASE);
 	cprintf("Kernel executable memory footprint: %dKB\n",
 		ROUNDUP(end - entry, 1024) / 1024);
+	if (debuginfo_loaded())
+		cprintf("Debug index loaded from disk: %dKB\n",
+			ROUNDUP(debuginfo_loaded(), 1024) / 1024);
+	cprintf("Console input bytes dropped: %u\n", cons_dropped());
+	cpu_print();
+	clock_print();
+	lapic_print();
+	ioapic_print();
+	timer_print();
+	pmu_print();
+	return 0;
+}
+
+int
+mon_dmesg(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "-c") != 0)) {
+		cprintf("Usage: dmesg [-c]\n");
+		return 0;
+	}
+	klog_dump(argc == 2);
+	return 0;
+}
+
+int
+mon_ktrace(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 2 && strcmp(argv[1], "on") == 0)
+		ktrace_enabled = 1;
+	else if (argc == 2 && strcmp(argv[1], "off") == 0)
+		ktrace_enabled = 0;
+	else if (argc == 2 && strcmp(argv[1], "dump") == 0)
+		ktrace_dump();
+	else if (argc == 2 && strcmp(argv[1], "clear") == 0)
+		ktrace_clear();
+	else
+		cprintf("Usage: ktrace on|off|dump|clear\n");
+	return 0;
+}
+
+int
+mon_symcache(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "-c") != 0)) {
+		cprintf("Usage: symcache [-c]\n");
+		return 0;
+	}
+	debuginfo_cache_stats(argc == 2);
+	return 0;
+}
+
+int
+mon_prof(int argc, char **argv, struct Trapframe *tf)
+{
+	long hz = PROF_HZ;
+
+	if (argc >= 2 && argc <= 3 && strcmp(argv[1], "start") == 0) {
+		if (argc == 3)
+			hz = strtol(argv[2], NULL, 0);
+		if (hz < 20 || hz > 10000) {
+			cprintf("prof: rate must be 20 to 10000 Hz\n");
+			return 0;
+		}
+		if (!prof_start(hz))
+			cprintf("prof: needs the I/O APIC to sample by NMI\n");
+	} else if (argc == 2 && strcmp(argv[1], "stop") == 0)
+		prof_stop();
+	else if (argc == 2 && strcmp(argv[1], "report") == 0)
+		prof_report();
+	else
+		cprintf("Usage: prof start [hz]|stop|report\n");
+	return 0;
+}
+
+int
+mon_perf(int argc, char **argv, struct Trapframe *tf)
+{
+	struct PmuSnapshot before, after;
+	int r;
+
+	if (argc < 2) {
+		cprintf("Usage: perf <cmd> [args]\n");
+		return 0;
+	}
+	pmu_start();
+	pmu_read(&before);
+	r = runargs(argc - 1, argv + 1, tf);
+	pmu_read(&after);
+	pmu_stop();
+	pmu_report(&before, &after);
+	return r;
+}
+
+int
+mon_bench(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 2) {
+		cprintf("Usage: bench [name|all]\n");
+		return 0;
+	}
+	if (argc == 1) {
+		cprintf("Benchmarks:\n");
+		bench_list();
+	} else if (bench_run(argv[1]) == 0)
+		cprintf("bench: no benchmark '%s'\n", argv[1]);
+	return 0;
+}
+
+int
+mon_cpus(int argc, char **argv, struct Trapframe *tf)
+{
+	static const char *const status[] = {
+		[CPU_UNUSED] "not started",
+		[CPU_STARTED] "running",
+		[CPU_HALTED] "halted",
+	};
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		cprintf("CPU %d%s: APIC ID %u, %s, %llu traps, %llu NMIs\n",
+			i, &cpus[i] == bootcpu ? " (BSP)" : "",
+			cpus[i].cpu_apicid, status[cpus[i].cpu_status],
+			*per_cpu_ptr(&cpu_ntraps, i) + *per_cpu_ptr(&cpu_nnmis, i),
+			*per_cpu_ptr(&cpu_nnmis, i));
+	return 0;
+}
+
+int
+mon_sched(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 1)
+		sched_print();
+	else if (argc == 4 && strcmp(argv[1], "test") == 0)
+		sched_test(strtol(argv[2], NULL, 0), strtol(argv[3], NULL, 0));
+	else
+		cprintf("Usage: sched [test <ntasks> <us>]\n");
+	return 0;
+}
+
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 1)
+		lockstat_print(10);
+	else if (argc == 2 && strcmp(argv[1], "on") == 0)
+		lockstat_enabled = 1;
+	else if (argc == 2 && strcmp(argv[1], "off") == 0)
+		lockstat_enabled = 0;
+	else if (argc == 2 && strcmp(argv[1], "clear") == 0)
+		lockstat_clear();
+	else if (argc == 2 && strtol(argv[1], NULL, 0) > 0)
+		lockstat_print(strtol(argv[1], NULL, 0));
+	else
+		cprintf("Usage: lockstat [on|off|clear|<n>]\n");
+	return 0;
+}
+
+int
+mon_irq(int argc, char **argv, struct Trapframe *tf)
+{
+	long irq, cpu;
+
+	if (argc == 1) {
+		ioapic_print();
+		return 0;
+	}
+	if (argc != 3) {
+		cprintf("Usage: irq [<irq> <cpu>]\n");
+		return 0;
+	}
+	irq = strtol(argv[1], NULL, 0);
+	cpu = strtol(argv[2], NULL, 0);
+	if (!ioapic_active)
+		cprintf("irq: interrupts come from the 8259A, which cannot steer them\n");
+	else if (irq < 0 || irq >= 16 || irq == IRQ_SLAVE)
+		cprintf("irq: no ISA IRQ %ld\n", irq);
+	else if (cpu < 0 || cpu >= ncpu || cpus[cpu].cpu_status != CPU_STARTED)
+		cprintf("irq: CPU %ld is not running\n", cpu);
+	else
+		ioapic_steer(irq, cpu);
+	return 0;
+}
+
+int
+mon_sleep(int argc, char **argv, struct Trapframe *tf)
+{
+	uint64_t start;
+	long ms;
+
+	if (argc != 2 || (ms = strtol(argv[1], NULL, 0)) <= 0) {
+		cprintf("Usage: sleep <ms>\n");
+		return 0;
+	}
+	if (tsc_khz == 0) {
+		cprintf("sleep: the TSC frequency is unknown\n");
+		return 0;
+	}
+	start = clock_ns();
+	timer_sleep(ms * 1000000ULL);
+	cprintf("slept %llu us\n", (clock_ns() - start) / 1000);
 	return 0;
 }
 
 int
 mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 {
-	// Your code here.
+	uint32_t *ebp = (uint32_t *) read_ebp();
+	struct Eipdebuginfo info;
+	int i;
+
+	cprintf("Stack backtrace:\n");
+	while (ebp) {
+		cprintf("  ebp %08x  eip %08x  args", ebp, ebp[1]);
+		for (i = 2; i < 7; i++)
+			cprintf(" %08x", ebp[i]);
+		cprintf("\n");
+		// ebp[1] is a return address: look up the call before it.
+		debuginfo_eip(ebp[1] - 1, &info);
+		cprintf("         %s:%d: %.*s+%d\n", info.eip_file, info.eip_line,
+			info.eip_fn_namelen, info.eip_fn_name,
+			ebp[1] - info.eip_fn_addr);
+		ebp = (uint32_t *) ebp[0];
+	}
 	return 0;
 }
 
@@ -73,7 +316,6 @@ runcmd(char *buf, struct Trapframe *tf)
 {
 	int argc;
 	char *argv[MAXARGS];
-	int i;
 
 	// Parse the command buffer into whitespace-separated arguments
 	argc = 0;
@@ -99,14 +341,32 @@ runcmd(char *buf, struct Trapframe *tf)
 	// Lookup and invoke the command
 	if (argc == 0)
 		return 0;
-	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+	return runargs(argc, argv, tf);
+}
+
+// Invoke the command named by argv[0].  Also used by commands such as
+// 'perf' that run another command.
+static int
+runargs(int argc, char **argv, struct Trapframe *tf)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
 		if (strcmp(argv[0], commands[i].name) == 0)
 			return commands[i].func(argc, argv, tf);
-	}
 	cprintf("Unknown command '%s'\n", argv[0]);
 	return 0;
 }
 
+int
+monitor_cmd(const char *cmd, struct Trapframe *tf)
+{
+	char buf[CMDBUF_SIZE];
+
+	strlcpy(buf, cmd, sizeof(buf));
+	return runcmd(buf, tf);
+}
+
 void
 monitor(struct Trapframe *tf)
 {
@@ -117,6 +377,9 @@ monitor(struct Trapframe *tf)
 
 
 	while (1) {
+		// Flush the kernel log before waiting for a command, so
+		// the console (and anyone watching it) is up to date.
+		klog_drain();
 		buf = readline("K> ");
 		if (buf != NULL)
 			if (runcmd(buf, tf) < 0)
@@ -11,9 +11,23 @@ struct Trapframe;
 // (NULL if none).
 void monitor(struct Trapframe *tf);
 
+// Run one monitor command line, as if it had been typed at the prompt.
+int monitor_cmd(const char *cmd, struct Trapframe *tf);
+
 // Functions implementing monitor commands.
 int mon_help(int argc, char **argv, struct Trapframe *tf);
 int mon_kerninfo(int argc, char **argv, struct Trapframe *tf);
+int mon_dmesg(int argc, char **argv, struct Trapframe *tf);
+int mon_ktrace(int argc, char **argv, struct Trapframe *tf);
+int mon_symcache(int argc, char **argv, struct Trapframe *tf);
+int mon_prof(int argc, char **argv, struct Trapframe *tf);
+int mon_perf(int argc, char **argv, struct Trapframe *tf);
+int mon_bench(int argc, char **argv, struct Trapframe *tf);
+int mon_cpus(int argc, char **argv, struct Trapframe *tf);
+int mon_sched(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_irq(int argc, char **argv, struct Trapframe *tf);
+int mon_sleep(int argc, char **argv, struct Trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
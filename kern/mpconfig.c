@@ -0,0 +1,460 @@
+// Search for and parse the multiprocessor configuration table.
+// The ACPI MADT is preferred; the older Intel MultiProcessor
+// Specification tables are used if there is no MADT.
+// See http://www.intel.com/design/pentium/datashts/24201606.pdf
+// and chapter 5.2.12 of the ACPI specification.
+
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/ioapic.h>
+#include <kern/pmap.h>
+
+struct CpuInfo cpus[NCPU];
+struct CpuInfo *bootcpu;
+int ncpu;
+
+struct IoapicInfo ioapics[NIOAPIC];
+int nioapic;
+struct IsaIrq isa_irqs[16];
+
+const char *mp_source;
+bool mp_imcrp;			// the IMCR selects PIC or APIC mode
+
+// See MultiProcessor Specification Version 1.[14]
+
+struct mp {             // floating pointer [MP 4.1]
+	uint8_t signature[4];           // "_MP_"
+	physaddr_t physaddr;            // phys addr of MP config table
+	uint8_t length;                 // 1
+	uint8_t specrev;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t type;                   // MP system config type
+	uint8_t imcrp;
+	uint8_t reserved[3];
+} __attribute__((__packed__));
+
+struct mpconf {         // configuration table header [MP 4.2]
+	uint8_t signature[4];           // "PCMP"
+	uint16_t length;                // total table length
+	uint8_t version;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t product[20];            // product id
+	physaddr_t oemtable;            // OEM table pointer
+	uint16_t oemlength;             // OEM table length
+	uint16_t entry;                 // entry count
+	physaddr_t lapicaddr;           // address of local APIC
+	uint16_t xlength;               // extended table length
+	uint8_t xchecksum;              // extended table checksum
+	uint8_t reserved;
+	uint8_t entries[0];             // table entries
+} __attribute__((__packed__));
+
+struct mpproc {         // processor table entry [MP 4.3.1]
+	uint8_t type;                   // entry type (0)
+	uint8_t apicid;                 // local APIC id
+	uint8_t version;                // local APIC version
+	uint8_t flags;                  // CPU flags
+	uint8_t signature[4];           // CPU signature
+	uint32_t feature;               // feature flags from CPUID instruction
+	uint8_t reserved[8];
+} __attribute__((__packed__));
+
+struct mpbus {          // bus table entry [MP 4.3.2]
+	uint8_t type;                   // entry type (1)
+	uint8_t busid;
+	char bustype[6];                // "ISA   ", "PCI   ", ...
+} __attribute__((__packed__));
+
+struct mpioapic {       // I/O APIC table entry [MP 4.3.3]
+	uint8_t type;                   // entry type (2)
+	uint8_t apicno;                 // I/O APIC id
+	uint8_t version;                // I/O APIC version
+	uint8_t flags;                  // I/O APIC flags
+	physaddr_t addr;                // I/O APIC address
+} __attribute__((__packed__));
+
+struct mpiointr {       // I/O interrupt assignment entry [MP 4.3.4]
+	uint8_t type;                   // entry type (3)
+	uint8_t intrtype;               // 0 = vectored interrupt
+	uint16_t flags;                 // polarity and trigger mode
+	uint8_t srcbus;                 // source bus id
+	uint8_t srcbusirq;              // source bus IRQ
+	uint8_t dstapic;                // destination I/O APIC id
+	uint8_t dstirq;                 // destination I/O APIC pin
+} __attribute__((__packed__));
+
+// mpproc flags
+#define MPPROC_BOOT 0x02                // This mpproc is the bootstrap processor
+// mpioapic flags
+#define MPIOAPIC_EN 0x01                // This I/O APIC is usable
+
+// Table entry types
+#define MPPROC    0x00  // One per processor
+#define MPBUS     0x01  // One per bus
+#define MPIOAPIC  0x02  // One per I/O APIC
+#define MPIOINTR  0x03  // One per bus interrupt source
+#define MPLINTR   0x04  // One per system interrupt source
+
+// Polarity and trigger mode flags, shared by the MP table's I/O
+// interrupt entries and the MADT's interrupt source overrides
+#define INTI_PO_MASK	0x3
+#define INTI_PO_LOW	0x3
+#define INTI_EL_MASK	0xC
+#define INTI_EL_LEVEL	0xC
+
+// ACPI tables [ACPI 5.2]
+
+struct rsdp {           // root system description pointer [ACPI 5.2.5]
+	char signature[8];              // "RSD PTR "
+	uint8_t checksum;               // first 20 bytes add up to 0
+	char oemid[6];
+	uint8_t revision;
+	uint32_t rsdtaddr;              // phys addr of the RSDT
+} __attribute__((__packed__));
+
+struct acpihdr {        // system description table header [ACPI 5.2.6]
+	char signature[4];
+	uint32_t length;                // including this header
+	uint8_t revision;
+	uint8_t checksum;               // all bytes must add up to 0
+	char oemid[6];
+	char oemtableid[8];
+	uint32_t oemrevision;
+	uint32_t creatorid;
+	uint32_t creatorrevision;
+} __attribute__((__packed__));
+
+struct madt {           // multiple APIC description table [ACPI 5.2.12]
+	struct acpihdr hdr;             // "APIC"
+	uint32_t lapicaddr;
+	uint32_t flags;
+	uint8_t entries[0];             // {type, length, ...}
+} __attribute__((__packed__));
+
+// MADT entry types
+#define MADT_LAPIC      0x00    // processor local APIC
+#define MADT_IOAPIC     0x01    // I/O APIC
+#define MADT_ISO        0x02    // interrupt source override
+#define MADT_X2APIC     0x09    // processor local x2APIC
+
+#define MADT_LAPIC_EN   0x01    // processor is usable
+
+static uint8_t
+sum(void *addr, int len)
+{
+	int i, sum;
+
+	sum = 0;
+	for (i = 0; i < len; i++)
+		sum += ((uint8_t *)addr)[i];
+	return sum;
+}
+
+// Look for an MP structure in the len bytes at physical address addr.
+static struct mp *
+mpsearch1(physaddr_t a, int len)
+{
+	struct mp *mp = KADDR(a), *end = KADDR(a + len);
+
+	for (; mp < end; mp++)
+		if (memcmp(mp->signature, "_MP_", 4) == 0 &&
+		    sum(mp, sizeof(*mp)) == 0)
+			return mp;
+	return NULL;
+}
+
+// Search the BIOS data areas for a signature on a 16-byte boundary:
+// 1) in the first KB of the EBDA;
+// 2) if there is no EBDA, in the last KB of system base memory;
+// 3) in the BIOS ROM between 0xF0000 and 0xFFFFF.
+static void *
+biossearch(void *(*search)(physaddr_t, int))
+{
+	uint8_t *bda;
+	uint32_t p;
+	void *r;
+
+	static_assert(sizeof(struct mp) == 16);
+
+	// The BIOS data area lives in 16-bit segment 0x40.
+	bda = (uint8_t *) KADDR(0x40 << 4);
+
+	// [MP 4] The 16-bit segment of the EBDA is in the two bytes
+	// starting at byte 0x0E of the BDA.  0 if not present.
+	if ((p = *(uint16_t *) (bda + 0x0E))) {
+		p <<= 4;	// Translate from segment to PA
+		if ((r = search(p, 1024)))
+			return r;
+	} else {
+		// The size of base memory, in KB is in the two bytes
+		// starting at 0x13 of the BDA.
+		p = *(uint16_t *) (bda + 0x13) * 1024;
+		if ((r = search(p - 1024, 1024)))
+			return r;
+	}
+	return search(0xE0000, 0x20000);
+}
+
+static struct mp *
+mpsearch(void)
+{
+	return biossearch((void *(*)(physaddr_t, int)) mpsearch1);
+}
+
+// Look for an RSDP in the len bytes at physical address addr.
+static struct rsdp *
+rsdpsearch1(physaddr_t a, int len)
+{
+	uint8_t *p = KADDR(a), *end = KADDR(a + len);
+
+	for (; p < end; p += 16)
+		if (memcmp(p, "RSD PTR ", 8) == 0 &&
+		    sum(p, sizeof(struct rsdp)) == 0)
+			return (struct rsdp *) p;
+	return NULL;
+}
+
+// Map the ACPI table at physical address pa.  Tables above the first
+// 4MB are mapped (uncached) in the MMIO region; they are only read
+// once, at boot.
+static struct acpihdr *
+acpi_map(physaddr_t pa)
+{
+	struct acpihdr *h;
+
+	if (pa + sizeof(*h) <= PTSIZE)
+		h = KADDR(pa);
+	else
+		h = mmio_map_region(pa, sizeof(*h));
+	if (pa + h->length <= PTSIZE || h->length <= PGSIZE - PGOFF(pa))
+		return h;
+	return mmio_map_region(pa, h->length);
+}
+
+// Find the MADT through the RSDP and RSDT.
+static struct madt *
+madtsearch(void)
+{
+	struct rsdp *rsdp;
+	struct acpihdr *rsdt, *h;
+	uint32_t *entry;
+	int i, n;
+
+	if ((rsdp = biossearch((void *(*)(physaddr_t, int)) rsdpsearch1)) == NULL)
+		return NULL;
+	rsdt = acpi_map(rsdp->rsdtaddr);
+	if (memcmp(rsdt->signature, "RSDT", 4) != 0
+	    || sum(rsdt, rsdt->length) != 0)
+		return NULL;
+	entry = (uint32_t *) (rsdt + 1);
+	n = (rsdt->length - sizeof(*rsdt)) / 4;
+	for (i = 0; i < n; i++) {
+		h = acpi_map(entry[i]);
+		if (memcmp(h->signature, "APIC", 4) == 0
+		    && sum(h, h->length) == 0)
+			return (struct madt *) h;
+	}
+	return NULL;
+}
+
+static void
+add_cpu(uint32_t apicid)
+{
+	if (ncpu < NCPU) {
+		cpus[ncpu].cpu_id = ncpu;
+		cpus[ncpu].cpu_apicid = apicid;
+		ncpu++;
+	} else {
+		cprintf("SMP: too many CPUs, CPU %d disabled\n", apicid);
+	}
+}
+
+static void
+add_ioapic(uint8_t id, physaddr_t addr, uint32_t gsibase)
+{
+	if (nioapic < NIOAPIC) {
+		ioapics[nioapic].id = id;
+		ioapics[nioapic].addr = addr;
+		ioapics[nioapic].gsibase = gsibase;
+		nioapic++;
+	} else {
+		cprintf("SMP: too many I/O APICs, I/O APIC %d ignored\n", id);
+	}
+}
+
+// Record that ISA IRQ 'irq' arrives on 'gsi', with the given MP/ACPI
+// polarity and trigger flags.
+static void
+add_override(uint8_t irq, uint32_t gsi, uint16_t inti)
+{
+	if (irq >= ARRAY_SIZE(isa_irqs))
+		return;
+	isa_irqs[irq].gsi = gsi;
+	isa_irqs[irq].flags = 0;
+	if ((inti & INTI_PO_MASK) == INTI_PO_LOW)
+		isa_irqs[irq].flags |= IRQ_POLARITY_LOW;
+	if ((inti & INTI_EL_MASK) == INTI_EL_LEVEL)
+		isa_irqs[irq].flags |= IRQ_TRIGGER_LEVEL;
+}
+
+static bool
+madt_parse(struct madt *madt)
+{
+	uint8_t *p, *e;
+
+	for (p = madt->entries, e = (uint8_t *) madt + madt->hdr.length;
+	     p + 2 <= e && p[1] >= 2; p += p[1]) {
+		switch (p[0]) {
+		case MADT_LAPIC:
+			if (*(uint32_t *) (p + 4) & MADT_LAPIC_EN)
+				add_cpu(p[3]);
+			break;
+		case MADT_X2APIC:
+			if (*(uint32_t *) (p + 8) & MADT_LAPIC_EN)
+				add_cpu(*(uint32_t *) (p + 4));
+			break;
+		case MADT_IOAPIC:
+			add_ioapic(p[2], *(uint32_t *) (p + 4), *(uint32_t *) (p + 8));
+			break;
+		case MADT_ISO:
+			if (p[2] == 0)	// bus 0 is ISA
+				add_override(p[3], *(uint32_t *) (p + 4),
+					     *(uint16_t *) (p + 8));
+			break;
+		}
+	}
+	return ncpu > 0;
+}
+
+// Search for an MP configuration table.  For now, don't accept the
+// default configurations (physaddr == 0).
+// Check for the correct signature, checksum, and version.
+static struct mpconf *
+mpconfig(struct mp **pmp)
+{
+	struct mpconf *conf;
+	struct mp *mp;
+
+	if ((mp = mpsearch()) == 0)
+		return NULL;
+	if (mp->physaddr == 0 || mp->type != 0) {
+		cprintf("SMP: Default configurations not implemented\n");
+		return NULL;
+	}
+	conf = (struct mpconf *) KADDR(mp->physaddr);
+	if (memcmp(conf, "PCMP", 4) != 0) {
+		cprintf("SMP: Incorrect MP configuration table signature\n");
+		return NULL;
+	}
+	if (sum(conf, conf->length) != 0) {
+		cprintf("SMP: Bad MP configuration checksum\n");
+		return NULL;
+	}
+	if (conf->version != 1 && conf->version != 4) {
+		cprintf("SMP: Unsupported MP version %d\n", conf->version);
+		return NULL;
+	}
+	if ((sum((uint8_t *)conf + conf->length, conf->xlength) + conf->xchecksum) & 0xff) {
+		cprintf("SMP: Bad MP configuration extended checksum\n");
+		return NULL;
+	}
+	*pmp = mp;
+	return conf;
+}
+
+static bool
+mpconf_parse(struct mpconf *conf)
+{
+	struct mpioapic *ioapic;
+	struct mpiointr *intr;
+	uint8_t *p, isabus = 0xFF;
+	int i;
+
+	for (p = conf->entries, i = 0; i < conf->entry; i++) {
+		switch (*p) {
+		case MPPROC:
+			add_cpu(((struct mpproc *) p)->apicid);
+			p += sizeof(struct mpproc);
+			continue;
+		case MPBUS:
+			if (memcmp(((struct mpbus *) p)->bustype, "ISA   ", 6) == 0)
+				isabus = ((struct mpbus *) p)->busid;
+			p += 8;
+			continue;
+		case MPIOAPIC:
+			// The MP tables have no global system interrupt
+			// numbers, so only the first I/O APIC's pins can
+			// be named; the others are numbered after it once
+			// ioapic_init knows its size.
+			ioapic = (struct mpioapic *) p;
+			if (ioapic->flags & MPIOAPIC_EN)
+				add_ioapic(ioapic->apicno, ioapic->addr, 0);
+			p += 8;
+			continue;
+		case MPIOINTR:
+			intr = (struct mpiointr *) p;
+			if (intr->intrtype == 0 && intr->srcbus == isabus
+			    && nioapic > 0 && intr->dstapic == ioapics[0].id)
+				add_override(intr->srcbusirq, intr->dstirq, intr->flags);
+			p += 8;
+			continue;
+		case MPLINTR:
+			p += 8;
+			continue;
+		default:
+			cprintf("mpinit: unknown config type %x\n", *p);
+			return 0;
+		}
+	}
+	return ncpu > 0;
+}
+
+void
+mp_init(void)
+{
+	struct madt *madt;
+	struct mpconf *conf;
+	struct mp *mp;
+	uint32_t ebx, apicid;
+	int i;
+
+	// Until an override says otherwise, ISA IRQ i arrives on
+	// global system interrupt i, active high and edge triggered.
+	for (i = 0; i < ARRAY_SIZE(isa_irqs); i++)
+		isa_irqs[i].gsi = i;
+
+	if ((madt = madtsearch()) && madt_parse(madt))
+		mp_source = "ACPI";
+	else {
+		ncpu = nioapic = 0;
+		if ((conf = mpconfig(&mp)) && mpconf_parse(conf)) {
+			mp_source = "MP";
+			mp_imcrp = mp->imcrp;
+		} else
+			ncpu = nioapic = 0;
+	}
+
+	// The BSP is the CPU running this code.  Its initial APIC ID
+	// is in bits 31-24 of CPUID.1:EBX.
+	cpuid(1, NULL, &ebx, NULL, NULL);
+	apicid = ebx >> 24;
+	if (ncpu == 0) {
+		// Didn't like what we found; fall back to no MP.
+		ncpu = 1;
+		cpus[0].cpu_apicid = apicid;
+	}
+	bootcpu = &cpus[0];
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_apicid == apicid)
+			bootcpu = &cpus[i];
+
+	cprintf("SMP: CPU %d found %d CPU(s)%s%s\n", bootcpu->cpu_id, ncpu,
+		mp_source ? " via " : "", mp_source ? mp_source : "");
+}
@@ -0,0 +1,44 @@
+// Per-CPU data areas (see kern/percpu.h).
+
+#include <inc/assert.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
+
+#include <kern/percpu.h>
+
+extern char __PERCPU_BEGIN__[], __PERCPU_END__[];
+extern struct Segdesc gdt[];
+
+// Each CPU's copy of the .percpu section
+static uint8_t percpu_areas[NCPU][PERCPU_SIZE]
+	__attribute__((aligned(PERCPU_ALIGN)));
+
+uintptr_t percpu_offsets[NCPU];
+
+DEFINE_PERCPU(uintptr_t, percpu_offset);
+DEFINE_PERCPU(int, cpu_number) = -1;
+
+// Give every CPU found by mp_init a copy of the per-CPU template and a
+// GDT segment whose base makes template addresses land in that copy.
+// Runs once, on the boot CPU, before any CPU loads its segment.
+void
+percpu_init(void)
+{
+	size_t size = __PERCPU_END__ - __PERCPU_BEGIN__;
+	int i;
+
+	static_assert(PERCPU_SIZE % PERCPU_ALIGN == 0);
+	if (size > PERCPU_SIZE)
+		panic("percpu_init: .percpu is %u bytes, PERCPU_SIZE is %u",
+		      size, PERCPU_SIZE);
+
+	for (i = 0; i < ncpu; i++) {
+		percpu_offsets[i] = (uintptr_t) percpu_areas[i]
+			- (uintptr_t) __PERCPU_BEGIN__;
+		memmove(percpu_areas[i], __PERCPU_BEGIN__, size);
+		*per_cpu_ptr(&percpu_offset, i) = percpu_offsets[i];
+		*per_cpu_ptr(&cpu_number, i) = i;
+		gdt[GD_PERCPU(i) >> 3] = (struct Segdesc)
+			SEG(STA_W, percpu_offsets[i], 0xffffffff, 0);
+	}
+}
@@ -0,0 +1,154 @@
+#ifndef JOS_KERN_PERCPU_H
+#define JOS_KERN_PERCPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <kern/cpu.h>
+
+// Per-CPU variables.
+//
+// DEFINE_PERCPU places a variable in the .percpu section, which is only
+// a template: percpu_init gives every CPU its own copy, in a separate
+// cache-line aligned area, and points that CPU's %gs segment at it.
+// The this_cpu_* accessors address the running CPU's copy with a
+// single %gs-relative instruction, so there is no cpunum() lookup and
+// no false sharing with other CPUs.
+//
+//	DEFINE_PERCPU(uint32_t, nfaults);
+//	...
+//	this_cpu_inc(nfaults);
+//
+// The accessors take variables of 1, 2, 4 or 8 bytes.  Other CPUs'
+// copies, and larger per-CPU objects, are reached with per_cpu_ptr and
+// this_cpu_ptr.  Until percpu_init has run, %gs has base 0 and every
+// access goes to the template.
+
+// Bytes of per-CPU data each CPU gets; the .percpu section must fit.
+#define PERCPU_SIZE	4096
+#define PERCPU_ALIGN	64	// a cache line
+
+// GDT selector for CPU i's per-CPU data segment; these follow the
+// TSS descriptors.
+#define GD_PERCPU(i)	(GD_TSS0 + (NCPU + (i)) * 8)
+
+#define DEFINE_PERCPU(type, name) \
+	__attribute__((section(".percpu"))) __typeof__(type) name
+#define DECLARE_PERCPU(type, name) \
+	extern __typeof__(type) name
+
+// Offset from a per-CPU variable's template to CPU i's copy
+extern uintptr_t percpu_offsets[NCPU];
+DECLARE_PERCPU(uintptr_t, percpu_offset);	// this CPU's offset
+DECLARE_PERCPU(int, cpu_number);		// this CPU's index, or -1
+
+void percpu_init(void);
+
+#define per_cpu_ptr(ptr, cpu) \
+	((__typeof__(ptr)) ((uintptr_t) (ptr) + percpu_offsets[cpu]))
+#define this_cpu_ptr(ptr) \
+	((__typeof__(ptr)) ((uintptr_t) (ptr) + this_cpu_read(percpu_offset)))
+
+// Multi-byte values are handled as 32-bit words; 'var' names the
+// template, which the "m" operands below only use for its address.
+#define __percpu_word(var, i)	(((uint32_t *) &(var))[i])
+
+#define this_cpu_read(var)						\
+({									\
+	union { __typeof__(var) v; uint32_t w[2]; } __u;		\
+	switch (sizeof(var)) {						\
+	case 1:								\
+		asm volatile("movzbl %%gs:%1, %0"			\
+			     : "=r" (__u.w[0]) : "m" (var));		\
+		break;							\
+	case 2:								\
+		asm volatile("movzwl %%gs:%1, %0"			\
+			     : "=r" (__u.w[0]) : "m" (var));		\
+		break;							\
+	case 4:								\
+		asm volatile("movl %%gs:%1, %0"				\
+			     : "=r" (__u.w[0]) : "m" (var));		\
+		break;							\
+	case 8:								\
+		asm volatile("movl %%gs:%2, %0; movl %%gs:%3, %1"	\
+			     : "=&r" (__u.w[0]), "=r" (__u.w[1])	\
+			     : "m" (__percpu_word(var, 0)),		\
+			       "m" (__percpu_word(var, 1)));		\
+		break;							\
+	default:							\
+		__percpu_bad_size();					\
+	}								\
+	__u.v;								\
+})
+
+#define this_cpu_write(var, val)					\
+do {									\
+	union { __typeof__(var) v; uint32_t w[2]; } __u;		\
+	__u.v = (val);							\
+	switch (sizeof(var)) {						\
+	case 1:								\
+		asm volatile("movb %b1, %%gs:%0"			\
+			     : "=m" (var) : "qi" (__u.w[0]));		\
+		break;							\
+	case 2:								\
+		asm volatile("movw %w1, %%gs:%0"			\
+			     : "=m" (var) : "ri" (__u.w[0]));		\
+		break;							\
+	case 4:								\
+		asm volatile("movl %1, %%gs:%0"				\
+			     : "=m" (var) : "ri" (__u.w[0]));		\
+		break;							\
+	case 8:								\
+		asm volatile("movl %2, %%gs:%0; movl %3, %%gs:%1"	\
+			     : "=m" (__percpu_word(var, 0)),		\
+			       "=m" (__percpu_word(var, 1))		\
+			     : "ri" (__u.w[0]), "ri" (__u.w[1]));	\
+		break;							\
+	default:							\
+		__percpu_bad_size();					\
+	}								\
+} while (0)
+
+// Add 'n' to this CPU's copy of 'var'.  Each add is a single
+// instruction (two for 8-byte variables), so an interrupt handler on
+// the same CPU cannot lose an update; other CPUs never touch it.
+#define this_cpu_add(var, n)						\
+do {									\
+	uint64_t __n = (n);						\
+	switch (sizeof(var)) {						\
+	case 1:								\
+		asm volatile("addb %b1, %%gs:%0"			\
+			     : "+m" (var) : "qi" ((uint32_t) __n)	\
+			     : "cc");					\
+		break;							\
+	case 2:								\
+		asm volatile("addw %w1, %%gs:%0"			\
+			     : "+m" (var) : "ri" ((uint32_t) __n)	\
+			     : "cc");					\
+		break;							\
+	case 4:								\
+		asm volatile("addl %1, %%gs:%0"				\
+			     : "+m" (var) : "ri" ((uint32_t) __n)	\
+			     : "cc");					\
+		break;							\
+	case 8:								\
+		asm volatile("addl %2, %%gs:%0; adcl %3, %%gs:%1"	\
+			     : "+m" (__percpu_word(var, 0)),		\
+			       "+m" (__percpu_word(var, 1))		\
+			     : "ri" ((uint32_t) __n),			\
+			       "ri" ((uint32_t) (__n >> 32))		\
+			     : "cc");					\
+		break;							\
+	default:							\
+		__percpu_bad_size();					\
+	}								\
+} while (0)
+
+#define this_cpu_inc(var)	this_cpu_add(var, 1)
+
+// Never defined: a per-CPU access of an unsupported size fails to link.
+extern void __percpu_bad_size(void);
+
+#endif	// !JOS_KERN_PERCPU_H
@@ -0,0 +1,73 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+
+// Until the kernel sets up its own page tables, device registers are
+// mapped through this page table, which covers [MMIOBASE, MMIOLIM) and
+// is hooked into entry_pgdir the first time it is needed.
+__attribute__((__aligned__(PGSIZE)))
+static pte_t mmio_pgtable[NPTENTRIES];
+
+// Likewise for the per-CPU kernel stacks in [KSTACKTOP-PTSIZE, KSTACKTOP).
+__attribute__((__aligned__(PGSIZE)))
+static pte_t kstack_pgtable[NPTENTRIES];
+
+unsigned char percpu_kstacks[NCPU][KSTKSIZE]
+__attribute__ ((aligned(PGSIZE)));
+
+//
+// Map the kernel stacks of all CPUs.  CPU i's stack grows down from
+// KSTACKTOP_CPU(i), and the KSTKGAP below it is left unmapped, so that
+// an overflow faults instead of silently running into the next stack.
+//
+void
+mem_init_mp(void)
+{
+	uintptr_t va;
+	int i, pg;
+
+	entry_pgdir[PDX(KSTACKTOP - 1)] = PADDR(kstack_pgtable) | PTE_P | PTE_W;
+	for (i = 0; i < NCPU; i++)
+		for (pg = 0; pg < KSTKSIZE / PGSIZE; pg++) {
+			va = KSTACKTOP_CPU(i) - KSTKSIZE + pg * PGSIZE;
+			kstack_pgtable[PTX(va)] =
+				PADDR(percpu_kstacks[i] + pg * PGSIZE) | PTE_P | PTE_W;
+		}
+}
+
+//
+// Reserve size bytes in the MMIO region and map [pa,pa+size) at this
+// location.  Return the base of the reserved region.  size does *not*
+// have to be multiple of PGSIZE.
+//
+// The mapping is uncached (PTE_PCD|PTE_PWT): device registers must
+// not be cached, and their reads and writes have side effects.
+//
+void *
+mmio_map_region(physaddr_t pa, size_t size)
+{
+	// Where to start the next region.  Initially, this is the
+	// beginning of the MMIO region.  Because this is static, its
+	// value will be preserved between calls to mmio_map_region.
+	static uintptr_t base = MMIOBASE;
+	uintptr_t va, start = base;
+
+	if (!(entry_pgdir[PDX(MMIOBASE)] & PTE_P))
+		entry_pgdir[PDX(MMIOBASE)] = PADDR(mmio_pgtable) | PTE_P | PTE_W;
+
+	size = ROUNDUP(size + PGOFF(pa), PGSIZE);
+	if (size > MMIOLIM - base)
+		panic("mmio_map_region: out of MMIO space");
+	for (va = base; va < base + size; va += PGSIZE)
+		mmio_pgtable[PTX(va)] = (ROUNDDOWN(pa, PGSIZE) + (va - base))
+			| PTE_P | PTE_W | PTE_PCD | PTE_PWT;
+	base += size;
+	return (void *) (start + PGOFF(pa));
+}
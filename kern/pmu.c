@@ -0,0 +1,162 @@
+// Hardware performance counters.
+//
+// pmu_init reads the number and width of the general-purpose counters
+// from CPUID leaf 0xA.  pmu_start programs one counter per event and
+// pmu_read snapshots them with rdpmc; the 'perf' monitor command wraps
+// another command in two snapshots and prints the difference.
+
+#include <inc/mmu.h>
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+
+#include <kern/pmu.h>
+#include <kern/cpu.h>
+
+// Model-specific registers
+#define MSR_PERFEVTSEL0		0x186	// event select for counter 0
+#define MSR_PMC0		0x0C1	// counter 0
+#define MSR_PERF_GLOBAL_CTRL	0x38F	// enable bits, PMU version 2 and up
+
+// Event select fields
+#define EVTSEL_USR		(1 << 16)	// count at CPL > 0
+#define EVTSEL_OS		(1 << 17)	// count at CPL 0
+#define EVTSEL_EN		(1 << 22)	// counter enabled
+
+static const struct {
+	const char *name;
+	uint8_t event;
+	uint8_t umask;
+	int archbit;		// CPUID.0xA:EBX bit that marks it missing
+} events[PMU_NEVENTS] = {
+	[PMU_CYCLES] = { "cycles", 0x3C, 0x00, 0 },
+	[PMU_INSTRUCTIONS] = { "instructions", 0xC0, 0x00, 1 },
+	[PMU_LLC_MISSES] = { "llc-misses", 0x2E, 0x41, 4 },
+	[PMU_BRANCH_MISSES] = { "branch-misses", 0xC5, 0x00, 6 },
+	// Not architectural: DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK as
+	// found on family 6 CPUs from Sandy Bridge on.
+	[PMU_DTLB_MISSES] = { "dtlb-misses", 0x08, 0x01, -1 },
+};
+
+static struct {
+	uint8_t version;	// 0 if there is no architectural PMU
+	uint8_t ncounters;	// general-purpose counters
+	uint8_t width;		// bits per counter
+	int counter[PMU_NEVENTS];	// counter for each event, or -1
+} pmu;
+
+void
+pmu_init(void)
+{
+	uint32_t eax, ebx;
+	int i, n;
+
+	for (i = 0; i < PMU_NEVENTS; i++)
+		pmu.counter[i] = -1;
+	if (strcmp(cpufeat.vendor, "GenuineIntel") != 0 || cpufeat.maxleaf < 0xA)
+		return;
+	cpuid(0xA, &eax, &ebx, NULL, NULL);
+	pmu.version = eax & 0xFF;
+	pmu.ncounters = (eax >> 8) & 0xFF;
+	pmu.width = (eax >> 16) & 0xFF;
+	if (pmu.version == 0 || pmu.ncounters == 0)
+		return;
+
+	// Assign counters in event order while they last.  An event bit
+	// beyond the length CPUID reports (EAX[31:24]) is unavailable.
+	for (i = n = 0; i < PMU_NEVENTS && n < pmu.ncounters; i++) {
+		if (events[i].archbit >= 0
+		    && (events[i].archbit >= (eax >> 24)
+			|| (ebx >> events[i].archbit) & 1))
+			continue;
+		if (events[i].archbit < 0 && cpufeat.family != 6)
+			continue;
+		pmu.counter[i] = n++;
+	}
+
+	// Let user code read the counters with rdpmc too.
+	lcr4(rcr4() | CR4_PCE);
+}
+
+void
+pmu_print(void)
+{
+	if (pmu.version == 0) {
+		cprintf("PMU: none (TSC only)\n");
+		return;
+	}
+	cprintf("PMU: version %u, %u counters of %u bits\n",
+		pmu.version, pmu.ncounters, pmu.width);
+}
+
+// Program and zero a counter for each event that has one.
+void
+pmu_start(void)
+{
+	uint32_t enable = 0;
+	int i, c;
+
+	if (pmu.version == 0)
+		return;
+	if (pmu.version >= 2)
+		wrmsr(MSR_PERF_GLOBAL_CTRL, 0);
+	for (i = 0; i < PMU_NEVENTS; i++) {
+		if ((c = pmu.counter[i]) < 0)
+			continue;
+		wrmsr(MSR_PERFEVTSEL0 + c, 0);
+		wrmsr(MSR_PMC0 + c, 0);
+		wrmsr(MSR_PERFEVTSEL0 + c, EVTSEL_EN | EVTSEL_OS | EVTSEL_USR
+		      | events[i].umask << 8 | events[i].event);
+		enable |= 1 << c;
+	}
+	if (pmu.version >= 2)
+		wrmsr(MSR_PERF_GLOBAL_CTRL, enable);
+}
+
+void
+pmu_stop(void)
+{
+	int i;
+
+	if (pmu.version == 0)
+		return;
+	if (pmu.version >= 2)
+		wrmsr(MSR_PERF_GLOBAL_CTRL, 0);
+	for (i = 0; i < PMU_NEVENTS; i++)
+		if (pmu.counter[i] >= 0)
+			wrmsr(MSR_PERFEVTSEL0 + pmu.counter[i], 0);
+}
+
+void
+pmu_read(struct PmuSnapshot *snap)
+{
+	int i;
+
+	for (i = 0; i < PMU_NEVENTS; i++)
+		snap->count[i] = pmu.counter[i] < 0 ? 0 : rdpmc(pmu.counter[i]);
+	snap->tsc = read_tsc();
+}
+
+// Print what happened between two snapshots.  The counters are only
+// 'width' bits wide, so the differences are taken modulo that.
+void
+pmu_report(const struct PmuSnapshot *before, const struct PmuSnapshot *after)
+{
+	uint64_t mask = pmu.width >= 64 ? ~0ULL : (1ULL << pmu.width) - 1;
+	uint64_t d[PMU_NEVENTS], ipc;
+	int i;
+
+	cprintf("%16llu  tsc\n", after->tsc - before->tsc);
+	for (i = 0; i < PMU_NEVENTS; i++) {
+		if (pmu.counter[i] < 0)
+			continue;
+		d[i] = (after->count[i] - before->count[i]) & mask;
+		cprintf("%16llu  %s", d[i], events[i].name);
+		if (i == PMU_INSTRUCTIONS && pmu.counter[PMU_CYCLES] >= 0
+		    && d[PMU_CYCLES] != 0) {
+			ipc = d[i] * 100 / d[PMU_CYCLES];
+			cprintf("  # %llu.%02llu IPC", ipc / 100, ipc % 100);
+		}
+		cprintf("\n");
+	}
+}
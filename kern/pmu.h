@@ -0,0 +1,36 @@
+#ifndef JOS_KERN_PMU_H
+#define JOS_KERN_PMU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Intel architectural performance monitoring (CPUID leaf 0xA).  Each
+// PMU event gets one general-purpose counter, as long as there are
+// enough; on CPUs without the architectural PMU (including QEMU
+// without KVM) only the time stamp counter is reported.
+
+enum {
+	PMU_CYCLES,		// unhalted core cycles
+	PMU_INSTRUCTIONS,	// instructions retired
+	PMU_LLC_MISSES,		// last-level cache misses
+	PMU_BRANCH_MISSES,	// branch mispredictions retired
+	PMU_DTLB_MISSES,	// data TLB misses that walk the page tables
+	PMU_NEVENTS
+};
+
+struct PmuSnapshot {
+	uint64_t tsc;
+	uint64_t count[PMU_NEVENTS];
+};
+
+void pmu_init(void);
+void pmu_print(void);
+void pmu_start(void);
+void pmu_stop(void);
+void pmu_read(struct PmuSnapshot *snap);
+void pmu_report(const struct PmuSnapshot *before,
+		const struct PmuSnapshot *after);
+
+#endif	// !JOS_KERN_PMU_H
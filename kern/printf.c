@@ -1,25 +1,53 @@
 // Simple implementation of cprintf console output for the kernel,
-// based on printfmt() and the kernel console's cputchar().
+// based on printfmt() and the kernel log.  Output is buffered on the
+// stack and appended to the log, which drains it to the console
+// devices asynchronously (see kern/klog.c).
 
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
+#include <inc/string.h>
+
+#include <kern/klog.h>
+
+// Collect output runs, handing them to the log a buffer at a time.
+struct printbuf {
+	int idx;	// current buffer index
+	int cnt;	// total bytes printed so far
+	char buf[256];
+};
 
 
 static void
-putch(int ch, int *cnt)
+putn(const char *s, size_t n, struct printbuf *b)
 {
-	cputchar(ch);
-	*cnt++;
+	size_t m;
+
+	b->cnt += n;
+	while (n > 0) {
+		m = MIN(n, sizeof(b->buf) - b->idx);
+		memcpy(b->buf + b->idx, s, m);
+		b->idx += m;
+		s += m;
+		n -= m;
+		if (b->idx == sizeof(b->buf)) {
+			klog_write(b->buf, b->idx);
+			b->idx = 0;
+		}
+	}
 }
 
 int
 vcprintf(const char *fmt, va_list ap)
 {
-	int cnt = 0;
+	struct printbuf b;
 
-	vprintfmt((void*)putch, &cnt, fmt, ap);
-	return cnt;
+	b.idx = 0;
+	b.cnt = 0;
+	vprintfmt_n((void*)putn, &b, fmt, ap);
+	klog_write(b.buf, b.idx);
+
+	return b.cnt;
 }
 
 int
@@ -34,4 +62,3 @@ cprintf(const char *fmt, ...)
 
 	return cnt;
 }
-
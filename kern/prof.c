@@ -0,0 +1,317 @@
+// Statistical sampling profiler.
+//
+// The PIT interrupts the kernel at a fixed rate and prof_tick stores
+// the interrupted EIP followed by the return addresses found by
+// following the saved frame pointers (the kernel is compiled with
+// -fno-omit-frame-pointer).  prof_report symbolizes the samples with
+// debuginfo_eip and prints the functions that were hit most often,
+// then one line per distinct call chain in the "collapsed stack"
+// format read by flame graph tools:
+//
+//	i386_init;monitor;runcmd;mon_bench;memcpy 42
+//
+// The kernel runs with interrupts disabled except while it waits, so
+// the ticks are delivered as NMIs, which arrive regardless.  The I/O
+// APIC sends them to one CPU, which passes each on to the other CPUs
+// as an NMI IPI; every CPU then samples itself into its own buffer.
+// An NMI can interrupt any code, even with a lock held, so prof_tick
+// takes no lock and writes nothing but this CPU's buffer and the
+// LAPIC's ICR.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+
+#include <kern/prof.h>
+#include <kern/kclock.h>
+#include <kern/kdebug.h>
+#include <kern/trap.h>
+#include <kern/ioapic.h>
+#include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/percpu.h>
+
+struct ProfSample {
+	uint32_t depth;			// entries used in pc[]
+	uintptr_t pc[PROF_MAXDEPTH];	// pc[0] is the interrupted EIP
+};
+
+// Each CPU's samples.  Only that CPU writes them while the profiler
+// runs.  The buffers are too big for the per-CPU area, so it holds a
+// pointer to this CPU's row of prof_samples.
+struct ProfCpu {
+	struct ProfSample *samples;
+	uint32_t nsamples;
+	uint32_t dropped;		// ticks after the buffer filled
+	uintptr_t stack_lo, stack_hi;	// this CPU's kernel stack
+};
+
+static DEFINE_PERCPU(struct ProfCpu, prof_cpu);
+static struct ProfSample prof_samples[NCPU][PROF_NSAMPLES];
+extern char bootstack[], bootstacktop[];
+static unsigned prof_hz;
+
+bool prof_running;
+
+// Discard any earlier samples and start sampling 'hz' times a second.
+// Return 0 if the PIT cannot be made to send NMIs.
+bool
+prof_start(unsigned hz)
+{
+	struct ProfCpu *pc;
+	int i;
+
+	if (!ioapic_active)
+		return 0;
+	for (i = 0; i < ncpu; i++) {
+		pc = per_cpu_ptr(&prof_cpu, i);
+		pc->samples = prof_samples[i];
+		pc->nsamples = pc->dropped = 0;
+		// The boot CPU stays on the stack entry.S set up.
+		if (&cpus[i] == bootcpu) {
+			pc->stack_lo = (uintptr_t) bootstack;
+			pc->stack_hi = (uintptr_t) bootstacktop;
+		} else {
+			pc->stack_hi = KSTACKTOP_CPU(i);
+			pc->stack_lo = pc->stack_hi - KSTKSIZE;
+		}
+	}
+	prof_hz = hz;
+	prof_running = 1;
+	ioapic_nmi(IRQ_TIMER, 1);
+	pit_start(hz);
+	return 1;
+}
+
+void
+prof_stop(void)
+{
+	if (!prof_running)
+		return;
+	pit_stop();
+	ioapic_nmi(IRQ_TIMER, 0);
+	prof_running = 0;
+}
+
+// Record one sample of this CPU for the trap frame 'tf', and if this
+// CPU is the one that gets the PIT's NMIs, make the other CPUs take
+// theirs.  Frame pointers are only followed while they stay inside
+// this CPU's kernel stack and move up it, so a stray %ebp cannot send
+// the walk astray.
+void
+prof_tick(struct Trapframe *tf)
+{
+	struct ProfCpu *pc = this_cpu_ptr(&prof_cpu);
+	struct ProfSample *s;
+	uint32_t *ebp, *next;
+	int me = this_cpu_read(cpu_number), i;
+
+	if (!prof_running)
+		return;
+	if (me == ioapic_cpu(IRQ_TIMER))
+		for (i = 0; i < ncpu; i++)
+			if (i != me && cpus[i].cpu_status == CPU_STARTED)
+				lapic_nmi(i);
+	if (pc->nsamples == PROF_NSAMPLES) {
+		pc->dropped++;
+		return;
+	}
+	s = &pc->samples[pc->nsamples++];
+	s->pc[0] = tf->tf_eip;
+	s->depth = 1;
+	ebp = (uint32_t *) tf->tf_regs.reg_ebp;
+	while (s->depth < PROF_MAXDEPTH
+	       && (uintptr_t) ebp >= pc->stack_lo
+	       && (uintptr_t) ebp <= pc->stack_hi - 8
+	       && ((uintptr_t) ebp & 3) == 0) {
+		s->pc[s->depth++] = ebp[1];
+		next = (uint32_t *) ebp[0];
+		if (next <= ebp)
+			break;
+		ebp = next;
+	}
+}
+
+// Functions, by address, with their sample counts
+#define PROF_NFUNCS	512
+
+struct ProfFunc {
+	uintptr_t addr;
+	uint32_t self;			// samples with the EIP in the function
+	uint32_t total;			// samples with the function on the stack
+};
+
+static struct ProfFunc *
+prof_func(struct ProfFunc *funcs, uintptr_t addr)
+{
+	uint32_t h = (addr ^ (addr >> 9)) % PROF_NFUNCS, i;
+
+	for (i = 0; i < PROF_NFUNCS; i++, h = (h + 1) % PROF_NFUNCS)
+		if (funcs[h].addr == addr || funcs[h].addr == 0) {
+			funcs[h].addr = addr;
+			return &funcs[h];
+		}
+	return NULL;
+}
+
+// Distinct call chains: the first sample with the chain and how many
+// samples share it
+#define PROF_NSTACKS	1024
+
+struct ProfStack {
+	uint32_t first;
+	uint32_t count;
+};
+
+// Print the name of the function at 'addr', or the address itself if
+// it has none (as in assembly files).
+static void
+prof_print_name(uintptr_t addr)
+{
+	struct Eipdebuginfo info;
+
+	debuginfo_eip(addr, &info);
+	if (info.eip_fn_name[0] == '<')
+		cprintf("%08x", addr);
+	else
+		cprintf("%.*s", info.eip_fn_namelen, info.eip_fn_name);
+}
+
+// The i'th sample of all CPUs' samples taken together
+static struct ProfSample *
+prof_sample(uint32_t i)
+{
+	struct ProfCpu *pc;
+	int cpu;
+
+	for (cpu = 0; cpu < ncpu; cpu++) {
+		pc = per_cpu_ptr(&prof_cpu, cpu);
+		if (i < pc->nsamples)
+			return &pc->samples[i];
+		i -= pc->nsamples;
+	}
+	return NULL;
+}
+
+static void
+prof_print_stack(const struct ProfSample *s, uint32_t count)
+{
+	uint32_t j;
+
+	for (j = s->depth; j > 0; j--) {
+		prof_print_name(s->pc[j - 1]);
+		if (j > 1)
+			cprintf(";");
+	}
+	cprintf(" %u\n", count);
+}
+
+// Print the profile of all CPUs' samples.  The samples are rewritten
+// in place to hold function addresses instead of EIPs, so the report
+// can be repeated.
+void
+prof_report(void)
+{
+	static struct ProfFunc funcs[PROF_NFUNCS];
+	static struct ProfStack stacks[PROF_NSTACKS];
+	struct Eipdebuginfo info;
+	struct ProfSample *s, *t;
+	struct ProfFunc *f, *best;
+	struct ProfStack *st;
+	struct ProfCpu *pc;
+	uint32_t i, j, k, n, h, shown, dropped;
+	bool seen;
+	int cpu;
+
+	if (prof_running)
+		prof_stop();
+	n = dropped = 0;
+	for (cpu = 0; cpu < ncpu; cpu++) {
+		pc = per_cpu_ptr(&prof_cpu, cpu);
+		n += pc->nsamples;
+		dropped += pc->dropped;
+	}
+	cprintf("%u samples at %u Hz", n, prof_hz);
+	if (dropped)
+		cprintf(" (%u more dropped: buffer full)", dropped);
+	cprintf("\n");
+	for (cpu = 0; cpu < ncpu && ncpu > 1; cpu++) {
+		pc = per_cpu_ptr(&prof_cpu, cpu);
+		if (pc->nsamples || pc->dropped)
+			cprintf("  CPU %d: %u samples, %u dropped\n", cpu,
+				pc->nsamples, pc->dropped);
+	}
+	if (n == 0)
+		return;
+
+	// Map every PC to the start of its function and count each
+	// function once per sample for 'total'.
+	memset(funcs, 0, sizeof(funcs));
+	for (i = 0; i < n; i++) {
+		s = prof_sample(i);
+		for (j = 0; j < s->depth; j++) {
+			debuginfo_eip(s->pc[j], &info);
+			s->pc[j] = info.eip_fn_addr;
+			seen = 0;
+			for (k = 0; k < j; k++)
+				seen |= (s->pc[k] == s->pc[j]);
+			if (!(f = prof_func(funcs, s->pc[j])))
+				continue;
+			if (j == 0)
+				f->self++;
+			if (!seen)
+				f->total++;
+		}
+	}
+
+	// Top functions by self samples, selected by repeated scans
+	cprintf("   self      %%   total      %%  function\n");
+	for (shown = 0; shown < 20; shown++) {
+		best = NULL;
+		for (i = 0; i < PROF_NFUNCS; i++)
+			if (funcs[i].self && (!best || funcs[i].self > best->self))
+				best = &funcs[i];
+		if (!best)
+			break;
+		cprintf("%7u %5u.%u %7u %5u.%u  ", best->self,
+			best->self * 100 / n, best->self * 1000 / n % 10,
+			best->total, best->total * 100 / n,
+			best->total * 1000 / n % 10);
+		prof_print_name(best->addr);
+		cprintf("\n");
+		best->self = 0;
+	}
+
+	// Collapsed stacks, outermost function first.  Samples with the
+	// same chain are counted together; if there are more distinct
+	// chains than the table holds, the rest are printed one sample
+	// at a time, which flame graph tools add up just the same.
+	cprintf("# collapsed stacks\n");
+	memset(stacks, 0, sizeof(stacks));
+	for (i = 0; i < n; i++) {
+		s = prof_sample(i);
+		for (j = 0, h = 0; j < s->depth; j++)
+			h = h * 31 + (s->pc[j] >> 2);
+		for (k = 0; k < PROF_NSTACKS; k++, h++) {
+			st = &stacks[h % PROF_NSTACKS];
+			if (st->count == 0) {
+				st->first = i;
+				st->count = 1;
+				break;
+			}
+			t = prof_sample(st->first);
+			if (t->depth == s->depth
+			    && memcmp(t->pc, s->pc, s->depth * sizeof(s->pc[0])) == 0) {
+				st->count++;
+				break;
+			}
+		}
+		if (k == PROF_NSTACKS)
+			prof_print_stack(s, 1);
+	}
+	for (k = 0; k < PROF_NSTACKS; k++)
+		if (stacks[k].count)
+			prof_print_stack(prof_sample(stacks[k].first),
+					 stacks[k].count);
+}
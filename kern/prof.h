@@ -0,0 +1,28 @@
+#ifndef JOS_KERN_PROF_H
+#define JOS_KERN_PROF_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Trapframe;
+
+// Statistical sampling profiler.  While it runs, every PIT tick, sent
+// through the I/O APIC as an NMI and passed on to the other CPUs,
+// makes each CPU record the EIP it was interrupted at and the
+// frame-pointer call chain above it; 'prof report' then attributes the
+// samples of all CPUs to functions.
+
+#define PROF_NSAMPLES	2048	// samples kept per CPU; later ones are dropped
+#define PROF_MAXDEPTH	8	// return addresses kept per sample
+#define PROF_HZ		1000	// default sampling rate
+
+extern bool prof_running;
+
+bool prof_start(unsigned hz);
+void prof_stop(void);
+void prof_tick(struct Trapframe *tf);
+void prof_report(void);
+
+#endif	// !JOS_KERN_PROF_H
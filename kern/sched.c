@@ -0,0 +1,346 @@
+// Per-CPU run queues with work stealing (see kern/sched.h).
+//
+// Each CPU's queue lives in its per-CPU data and has its own lock, so
+// adding and picking a task are O(1) and CPUs do not contend unless
+// one of them steals.  A CPU that runs out of work scans the other
+// queues once and takes the oldest task of the longest one.
+
+#include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <inc/trap.h>
+
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/percpu.h>
+#include <kern/kclock.h>
+
+static DEFINE_PERCPU(struct RunQueue, runq);
+
+void
+task_init(struct Task *t, void (*fn)(void *), void *arg)
+{
+	t->next = NULL;
+	t->fn = fn;
+	t->arg = arg;
+	t->cpu = -1;
+	t->queued = 0;
+	t->nruns = 0;
+}
+
+// Called once on the boot CPU, after percpu_init.
+void
+sched_init(void)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		__spin_initlock(&per_cpu_ptr(&runq, i)->lock, "runq");
+}
+
+// Interrupt handlers may add tasks, so run queue locks are held with
+// interrupts off.
+static uint32_t
+runq_lock(struct RunQueue *rq)
+{
+	uint32_t eflags = read_eflags();
+
+	asm volatile("cli");
+	spin_lock(&rq->lock);
+	return eflags;
+}
+
+static void
+runq_unlock(struct RunQueue *rq, uint32_t eflags)
+{
+	spin_unlock(&rq->lock);
+	write_eflags(eflags);
+}
+
+// Take the first task off 'rq', whose lock must be held.
+static struct Task *
+runq_pop(struct RunQueue *rq)
+{
+	struct Task *t;
+
+	if (!(t = rq->head))
+		return NULL;
+	if (!(rq->head = t->next))
+		rq->tail = NULL;
+	rq->nqueued--;
+	t->next = NULL;
+	t->queued = 0;
+	return t;
+}
+
+// Whether another CPU should take work from 'rq': it has a backlog, or
+// its CPU is busy and will not get to the task soon.  An idle CPU's
+// single task is left for it, to stay cache-warm.
+static bool
+stealable(struct RunQueue *rq)
+{
+	return rq->nqueued >= 2 || (rq->nqueued == 1 && !rq->idle);
+}
+
+// Steal a task from the CPU with the longest run queue.
+static struct Task *
+sched_steal(int me)
+{
+	struct RunQueue *rq, *busiest = NULL;
+	struct Task *t = NULL;
+	uint32_t eflags;
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		rq = per_cpu_ptr(&runq, i);
+		if (i != me && stealable(rq)
+		    && (!busiest || rq->nqueued > busiest->nqueued))
+			busiest = rq;
+	}
+	if (!busiest)
+		return NULL;
+	eflags = runq_lock(busiest);
+	if (stealable(busiest))
+		t = runq_pop(busiest);
+	runq_unlock(busiest, eflags);
+	return t;
+}
+
+// Whether this CPU has work, its own or stolen.
+static bool
+sched_pending(int me)
+{
+	int i;
+
+	if (this_cpu_ptr(&runq)->nqueued)
+		return 1;
+	for (i = 0; i < ncpu; i++)
+		if (i != me && stealable(per_cpu_ptr(&runq, i)))
+			return 1;
+	return 0;
+}
+
+// Get idle CPU 'cpu' to look at the run queues.  A CPU in mwait wakes
+// on the store to need_resched alone; one in hlt needs an interrupt.
+static void
+sched_wake(int cpu)
+{
+	struct RunQueue *rq = per_cpu_ptr(&runq, cpu);
+
+	if (rq->need_resched)
+		return;		// already on its way
+	rq->wake_tsc = clock_tsc();
+	rq->need_resched = 1;
+	if (rq->idle == IDLE_HLT && cpu != cpunum())
+		lapic_ipi(cpu, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+// Make 't' runnable, on the CPU it last ran on or else on this one.
+// If that CPU is waiting for work, wake it; if it is busy, wake an
+// idle CPU to steal the task.
+void
+sched_add(struct Task *t)
+{
+	struct RunQueue *rq;
+	uint32_t eflags;
+	int me = cpunum(), target, i;
+
+	if (xchg(&t->queued, 1))
+		return;		// already queued
+	target = t->cpu >= 0 ? t->cpu : me;
+	rq = per_cpu_ptr(&runq, target);
+
+	eflags = runq_lock(rq);
+	if (rq->tail)
+		rq->tail->next = t;
+	else
+		rq->head = t;
+	rq->tail = t;
+	rq->nqueued++;
+	runq_unlock(rq, eflags);
+
+	// The unlock is a plain store, which x86 may let the loads of
+	// 'idle' below pass; the locked add is a full barrier that keeps
+	// the insertion visible before them.  (mfence would do, but needs
+	// SSE2.)  sched_idle's xchg on 'idle' orders its store before its
+	// last look at the queues the same way, so either it sees the
+	// task or this sees it idle.
+	asm volatile("lock; addl $0, (%%esp)" ::: "memory", "cc");
+	if (rq->idle) {
+		sched_wake(target);
+		return;
+	}
+	for (i = 0; i < ncpu; i++)
+		if (i != target && per_cpu_ptr(&runq, i)->idle) {
+			sched_wake(i);
+			return;
+		}
+}
+
+// Run one task from this CPU's queue, or one stolen from another CPU's.
+// Return 0 if there was none.
+bool
+sched_run(void)
+{
+	struct RunQueue *rq = this_cpu_ptr(&runq);
+	struct Task *t;
+	uint32_t eflags;
+	int me = cpunum();
+
+	eflags = runq_lock(rq);
+	t = runq_pop(rq);
+	runq_unlock(rq, eflags);
+	if (!t) {
+		if (!(t = sched_steal(me)))
+			return 0;
+		rq->nstolen++;
+	}
+	if (t->cpu >= 0 && t->cpu != me)
+		rq->nmigrated++;
+	t->cpu = me;
+	t->fn(t->arg);
+	rq->nran++;
+	// The owner may reuse 't' as soon as this is visible.
+	t->nruns++;
+	return 1;
+}
+
+// Run tasks for as long as there are any, then wait for sched_wake or
+// an interrupt.  The wait is in mwait, monitoring need_resched, if the
+// CPU has MONITOR/MWAIT, and in hlt otherwise.  Either way the CPU
+// stops executing, and a hypervisor can give its time to others.
+// Must be called without the big kernel lock.
+//
+// Tasks run with interrupts off, like the rest of the kernel; this CPU
+// takes its interrupts only in the wait, so no handler can nest inside
+// a task.
+void
+sched_idle(void)
+{
+	struct RunQueue *rq = this_cpu_ptr(&runq);
+	int me = cpunum();
+	uint64_t now;
+
+	asm volatile("cli");
+	for (;;) {
+		while (sched_run())
+			/* do nothing */;
+
+		// As in getchar, check for work with interrupts off, then
+		// wait with "sti; hlt" (or mwait): sti takes effect only
+		// after the next instruction, so an interrupt arriving
+		// after the check still ends the wait.  Interrupts go off
+		// again as soon as the wait ends.
+		rq->need_resched = 0;
+		if (cpufeat.mwait) {
+			xchg(&rq->idle, IDLE_MWAIT);
+			// A sched_wake between the checks and mwait writes
+			// the monitored line, which makes mwait return at
+			// once.  Hint 0 asks for C1, the shallowest state,
+			// which is the quickest to leave.
+			monitor_addr(&rq->need_resched);
+			if (!rq->need_resched && !sched_pending(me))
+				asm volatile("sti; mwait; cli"
+					     : : "a" (0), "c" (0) : "memory");
+		} else {
+			xchg(&rq->idle, IDLE_HLT);
+			if (!sched_pending(me))
+				asm volatile("sti; hlt; cli" ::: "memory");
+		}
+		rq->idle = IDLE_NONE;
+
+		// wake_tsc was taken on the waking CPU; clock_tsc corrects
+		// for the TSC offsets, to within the error of measuring them,
+		// which can leave a tiny latency negative.
+		if (rq->need_resched && rq->wake_tsc) {
+			now = clock_tsc();
+			rq->nwakeups++;
+			if (now > rq->wake_tsc)
+				rq->wake_cycles += now - rq->wake_tsc;
+			rq->wake_tsc = 0;
+		}
+	}
+}
+
+void
+sched_print(void)
+{
+	static const char *const idle[] = {
+		[IDLE_NONE] "busy",
+		[IDLE_HLT] "idle (hlt)",
+		[IDLE_MWAIT] "idle (mwait)",
+	};
+	struct RunQueue *rq;
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		if (cpus[i].cpu_status != CPU_STARTED)
+			continue;
+		rq = per_cpu_ptr(&runq, i);
+		cprintf("CPU %d: %u queued, %llu run, %llu stolen, "
+			"%llu migrated, %s\n", i, rq->nqueued, rq->nran,
+			rq->nstolen, rq->nmigrated, idle[rq->idle]);
+		if (rq->nwakeups)
+			cprintf("       %llu wakeups, %llu ns average latency\n",
+				rq->nwakeups, clock_cycles_to_ns(rq->wake_cycles)
+				/ rq->nwakeups);
+	}
+}
+
+#define SCHED_TEST_MAX		64
+#define SCHED_TEST_MAXUS	100000
+
+static void
+spin_task(void *arg)
+{
+	uint64_t end = read_tsc() + (uint32_t) arg;
+
+	while (read_tsc() < end)
+		asm volatile("pause");
+}
+
+// Queue 'ntasks' tasks on this CPU that each spin for 'us'
+// microseconds, help run them, and report how long they took.  With
+// idle CPUs stealing, the time should drop as CPUs are added.
+void
+sched_test(int ntasks, uint32_t us)
+{
+	static struct Task tasks[SCHED_TEST_MAX];
+	uint64_t start;
+	uint32_t cycles, done;
+	bool locked;
+	int i;
+
+	if (ntasks < 1 || ntasks > SCHED_TEST_MAX || us > SCHED_TEST_MAXUS) {
+		cprintf("sched: at most %d tasks of %d us\n",
+			SCHED_TEST_MAX, SCHED_TEST_MAXUS);
+		return;
+	}
+	if (!tsc_khz) {
+		cprintf("sched: TSC rate unknown\n");
+		return;
+	}
+
+	cycles = clock_ns_to_cycles(us * 1000ULL);
+
+	// Tasks run without the big kernel lock.
+	if ((locked = kernel_lock_held()))
+		unlock_kernel();
+	start = read_tsc();
+	for (i = 0; i < ntasks; i++) {
+		task_init(&tasks[i], spin_task, (void *) cycles);
+		sched_add(&tasks[i]);
+	}
+	do {
+		if (!sched_run())
+			asm volatile("pause");
+		for (done = i = 0; i < ntasks; i++)
+			done += tasks[i].nruns;
+	} while (done < ntasks);
+	start = read_tsc() - start;
+	if (locked)
+		lock_kernel();
+
+	cprintf("sched: %d tasks of %u us took %llu us\n", ntasks, us,
+		clock_cycles_to_ns(start) / 1000);
+}
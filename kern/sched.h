@@ -0,0 +1,62 @@
+#ifndef JOS_KERN_SCHED_H
+#define JOS_KERN_SCHED_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/spinlock.h>
+
+// Kernel tasks and per-CPU run queues.
+//
+// A task is a function that some CPU should call soon.  sched_add puts
+// it on the run queue of the CPU it last ran on, so that it finds its
+// data still in that CPU's cache; a CPU with nothing to do steals from
+// the busiest peer instead.  Tasks run without the big kernel lock; a
+// task that touches shared kernel state must take kernel_lock itself.
+// The caller owns the struct Task, which must stay put until the task
+// has run.  A task added again while it runs may start on another CPU
+// before the first run returns.
+
+struct Task {
+	struct Task *next;
+	void (*fn)(void *arg);
+	void *arg;
+	int cpu;			// CPU it last ran on, or -1
+	volatile uint32_t queued;	// on a run queue
+	volatile uint32_t nruns;	// times it has run
+};
+
+// How an idle CPU waits, in struct RunQueue's 'idle'
+enum {
+	IDLE_NONE = 0,		// not idle
+	IDLE_HLT,		// in hlt; wake it with IRQ_RESCHED
+	IDLE_MWAIT,		// in mwait on need_resched; storing wakes it
+};
+
+struct RunQueue {
+	struct spinlock lock;
+	struct Task *head, *tail;	// FIFO of runnable tasks
+	volatile uint32_t nqueued;
+	volatile uint32_t idle;		// IDLE_*
+
+	// Set to wake the CPU.  The idle CPU monitors this word's cache
+	// line, so nothing that other CPUs write often may share it.
+	volatile uint32_t need_resched __attribute__((aligned(64)));
+	uint64_t wake_tsc;		// clock_tsc() when need_resched was set
+	uint64_t nwakeups;		// times the CPU woke for work
+	uint64_t wake_cycles;		// total wakeup latency
+	uint64_t nran;			// tasks run
+	uint64_t nstolen;		// tasks taken from other queues
+	uint64_t nmigrated;		// tasks that last ran elsewhere
+};
+
+void task_init(struct Task *t, void (*fn)(void *), void *arg);
+void sched_init(void);
+void sched_add(struct Task *t);
+bool sched_run(void);
+void sched_idle(void) __attribute__((noreturn));
+void sched_print(void);
+void sched_test(int ntasks, uint32_t us);
+
+#endif	// !JOS_KERN_SCHED_H
@@ -0,0 +1,375 @@
+// Mutual exclusion spin locks.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/memlayout.h>
+#include <inc/string.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/kdebug.h>
+#include <kern/percpu.h>
+
+// The big kernel lock, and each CPU's place in its queue
+struct mcslock kernel_lock = {
+	.name = "kernel_lock"
+};
+static DEFINE_PERCPU(struct mcsnode, kernel_lock_node);
+
+bool lockstat_enabled;
+
+#define LOCKSTAT_SITES	128	// must be a power of 2
+
+// Statistics slots, hashed by call site and lock.  A slot is claimed
+// under lock_sites_busy and never freed, so lookups need no lock.
+static struct LockSite lock_sites[LOCKSTAT_SITES];
+static volatile uint32_t lock_sites_busy;
+static uint32_t lock_sites_full;	// acquisitions not recorded
+
+#ifdef DEBUG_SPINLOCK
+// Record the current call stack in pcs[] by following the %ebp chain.
+static void
+get_caller_pcs(uint32_t pcs[])
+{
+	uint32_t *ebp;
+	int i;
+
+	ebp = (uint32_t *)read_ebp();
+	for (i = 0; i < 10; i++){
+		if (ebp == 0 || ebp < (uint32_t *)ULIM)
+			break;
+		pcs[i] = ebp[1];          // saved %eip
+		ebp = (uint32_t *)ebp[0]; // saved %ebp
+	}
+	for (; i < 10; i++)
+		pcs[i] = 0;
+}
+#endif
+
+// Find the slot for 'lock' taken at 'pc'.  If there is none, return
+// NULL and set '*empty' to the first free slot on its probe sequence
+// (NULL if the table is full).
+static struct LockSite *
+lockstat_lookup(void *lock, uintptr_t pc, struct LockSite **empty)
+{
+	uint32_t h = pc ^ (pc >> 9) ^ ((uintptr_t) lock >> 3);
+	struct LockSite *s;
+	int i;
+
+	*empty = NULL;
+	for (i = 0; i < LOCKSTAT_SITES; i++) {
+		s = &lock_sites[(h + i) & (LOCKSTAT_SITES - 1)];
+		if (!s->pc) {
+			*empty = s;
+			return NULL;
+		}
+		if (s->pc == pc && s->lock == lock)
+			return s;
+	}
+	return NULL;
+}
+
+// Count an acquisition of 'lock' at 'pc' that began waiting at TSC
+// 'start', or did not wait if 'start' is 0, and store the time it was
+// acquired in '*acquired'.  The caller holds 'lock', which serializes
+// the updates to its slot.
+static struct LockSite *
+lockstat_acquired(void *lock, const char *name, uintptr_t pc,
+		  uint64_t start, uint64_t *acquired)
+{
+	struct LockSite *s, *empty;
+
+	*acquired = read_tsc();
+	if (!(s = lockstat_lookup(lock, pc, &empty))) {
+		while (xchg(&lock_sites_busy, 1) != 0)
+			asm volatile("pause");
+		if (!(s = lockstat_lookup(lock, pc, &empty)) && empty) {
+			s = empty;
+			s->lock = lock;
+			s->name = name;
+			// Fill in the slot before lookups can match it.
+			asm volatile("" ::: "memory");
+			s->pc = pc;
+		}
+		xchg(&lock_sites_busy, 0);
+		if (!s) {
+			lock_sites_full++;
+			return NULL;
+		}
+	}
+	s->nacquired++;
+	if (start) {
+		s->ncontended++;
+		s->spin_cycles += *acquired - start;
+	}
+	return s;
+}
+
+static void
+lockstat_released(struct LockSite *s, uint64_t acquired)
+{
+	uint64_t held = read_tsc() - acquired;
+
+	if (held > s->max_hold)
+		s->max_hold = held;
+}
+
+// Check whether this CPU is holding the lock.
+bool
+holding(struct spinlock *lock)
+{
+	return lock->next != lock->owner && lock->cpu == thiscpu;
+}
+
+void
+__spin_initlock(struct spinlock *lk, char *name)
+{
+	lk->next = 0;
+	lk->owner = 0;
+	lk->name = name;
+	lk->cpu = 0;
+	lk->site = NULL;
+}
+
+// Acquire the lock.
+// Loops (spins) until the lock is acquired.
+// Holding a lock for a long time may cause
+// other CPUs to waste time spinning to acquire it.
+void
+spin_lock(struct spinlock *lk)
+{
+	uint32_t ticket;
+	uint64_t start = 0;
+
+#ifdef DEBUG_SPINLOCK
+	if (holding(lk))
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+#endif
+
+	// Take a ticket and wait for it to be served.  The xadd is
+	// atomic, and it also serializes, so that reads after acquire
+	// are not reordered before it.
+	ticket = xadd(&lk->next, 1);
+	if (lk->owner != ticket) {
+		if (lockstat_enabled)
+			start = read_tsc();
+		while (lk->owner != ticket)
+			asm volatile ("pause");
+		asm volatile("" ::: "memory");
+	}
+
+	// Record info about lock acquisition for debugging.
+	lk->cpu = thiscpu;
+	if (lockstat_enabled)
+		lk->site = lockstat_acquired(lk, lk->name,
+				(uintptr_t) __builtin_return_address(0),
+				start, &lk->acquired);
+#ifdef DEBUG_SPINLOCK
+	get_caller_pcs(lk->pcs);
+#endif
+}
+
+// Release the lock.
+void
+spin_unlock(struct spinlock *lk)
+{
+#ifdef DEBUG_SPINLOCK
+	if (!holding(lk)) {
+		int i;
+		uint32_t pcs[10];
+		// Nab the acquiring EIP chain before it gets released
+		memmove(pcs, lk->pcs, sizeof pcs);
+		cprintf("CPU %d cannot release %s: held by CPU %d\nAcquired at:",
+			cpunum(), lk->name, lk->cpu ? lk->cpu->cpu_id : -1);
+		for (i = 0; i < 10 && pcs[i]; i++) {
+			struct Eipdebuginfo info;
+			if (debuginfo_eip(pcs[i], &info) >= 0)
+				cprintf("  %08x %s:%d: %.*s+%x\n", pcs[i],
+					info.eip_file, info.eip_line,
+					info.eip_fn_namelen, info.eip_fn_name,
+					pcs[i] - info.eip_fn_addr);
+			else
+				cprintf("  %08x\n", pcs[i]);
+		}
+		panic("spin_unlock");
+	}
+
+	lk->pcs[0] = 0;
+#endif
+	lk->cpu = 0;
+	if (lk->site) {
+		lockstat_released(lk->site, lk->acquired);
+		lk->site = NULL;
+	}
+
+	// Serve the next ticket.  x86 CPUs do not reorder stores with
+	// earlier loads or stores (vol 3, 8.2.2), so a plain store
+	// releases the lock; the empty asm keeps gcc from moving the
+	// critical section past it.
+	asm volatile("" ::: "memory");
+	lk->owner = lk->owner + 1;
+}
+
+// Check whether this CPU is holding the MCS lock.
+bool
+mcs_holding(struct mcslock *lk)
+{
+	return lk->tail != NULL && lk->cpu == thiscpu;
+}
+
+void
+__mcs_initlock(struct mcslock *lk, char *name)
+{
+	lk->tail = NULL;
+	lk->name = name;
+	lk->cpu = 0;
+	lk->site = NULL;
+}
+
+static void
+mcs_lock_at(struct mcslock *lk, struct mcsnode *node, uintptr_t pc)
+{
+	struct mcsnode *prev;
+	uint64_t start = 0;
+
+#ifdef DEBUG_SPINLOCK
+	if (mcs_holding(lk))
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+#endif
+
+	// Join the end of the queue.  If there was a waiter before us,
+	// link in behind it and spin on our own node until it hands the
+	// lock over.
+	node->next = NULL;
+	node->wait = 1;
+	prev = (struct mcsnode *) xchg((volatile uint32_t *) &lk->tail,
+				       (uint32_t) node);
+	if (prev) {
+		if (lockstat_enabled)
+			start = read_tsc();
+		prev->next = node;
+		while (node->wait)
+			asm volatile("pause");
+		asm volatile("" ::: "memory");
+	}
+
+	lk->cpu = thiscpu;
+	if (lockstat_enabled)
+		lk->site = lockstat_acquired(lk, lk->name, pc, start,
+					     &lk->acquired);
+}
+
+// Acquire the MCS lock, waiting on 'node'.
+void
+mcs_lock(struct mcslock *lk, struct mcsnode *node)
+{
+	mcs_lock_at(lk, node, (uintptr_t) __builtin_return_address(0));
+}
+
+// Release the MCS lock, which was acquired with 'node'.
+void
+mcs_unlock(struct mcslock *lk, struct mcsnode *node)
+{
+#ifdef DEBUG_SPINLOCK
+	if (!mcs_holding(lk))
+		panic("CPU %d cannot release %s: held by CPU %d", cpunum(),
+		      lk->name, lk->cpu ? lk->cpu->cpu_id : -1);
+#endif
+	lk->cpu = 0;
+	if (lk->site) {
+		lockstat_released(lk->site, lk->acquired);
+		lk->site = NULL;
+	}
+
+	if (!node->next) {
+		// No successor yet: free the lock, unless a waiter has
+		// swapped itself in as the tail but not linked in.
+		if (cmpxchg((volatile uint32_t *) &lk->tail, (uint32_t) node, 0)
+		    == (uint32_t) node)
+			return;
+		while (!node->next)
+			asm volatile("pause");
+	}
+	asm volatile("" ::: "memory");
+	node->next->wait = 0;
+}
+
+void
+lock_kernel(void)
+{
+	uint32_t eflags = read_eflags();
+
+	// An interrupt while this CPU waits would make trap() try to
+	// take the lock again, on the same node.
+	asm volatile("cli");
+	mcs_lock_at(&kernel_lock, this_cpu_ptr(&kernel_lock_node),
+		    (uintptr_t) __builtin_return_address(0));
+	write_eflags(eflags);
+}
+
+// Waiters are served in order, so this CPU cannot take the lock
+// straight back while others wait.
+void
+unlock_kernel(void)
+{
+	mcs_unlock(&kernel_lock, this_cpu_ptr(&kernel_lock_node));
+}
+
+bool
+kernel_lock_held(void)
+{
+	return mcs_holding(&kernel_lock);
+}
+
+// Print the 'n' lock sites with the most contended acquisitions.
+void
+lockstat_print(int n)
+{
+	struct LockSite *top[LOCKSTAT_SITES], *s;
+	struct Eipdebuginfo info;
+	int i, j, ntop = 0;
+
+	for (i = 0; i < LOCKSTAT_SITES; i++) {
+		s = &lock_sites[i];
+		if (!s->pc || !s->nacquired)
+			continue;
+		for (j = ntop++; j > 0 && top[j - 1]->ncontended < s->ncontended; j--)
+			top[j] = top[j - 1];
+		top[j] = s;
+	}
+
+	cprintf("lockstat: %s, %d sites\n", lockstat_enabled ? "on" : "off", ntop);
+	if (ntop > 0)
+		cprintf("  acquired  contended   avg spin   max hold  lock / site"
+			" (times in cycles)\n");
+	for (i = 0; i < ntop && i < n; i++) {
+		s = top[i];
+		cprintf("%10llu %10llu %10llu %10llu  %s ", s->nacquired,
+			s->ncontended,
+			s->ncontended ? s->spin_cycles / s->ncontended : 0,
+			s->max_hold, s->name);
+		if (debuginfo_eip(s->pc, &info) >= 0)
+			cprintf("%.*s+%x\n", info.eip_fn_namelen,
+				info.eip_fn_name, s->pc - info.eip_fn_addr);
+		else
+			cprintf("%08x\n", s->pc);
+	}
+	if (lock_sites_full)
+		cprintf("%u acquisitions not recorded: too many sites\n",
+			lock_sites_full);
+}
+
+// Reset the counts.  Slots stay assigned to their sites.
+void
+lockstat_clear(void)
+{
+	int i;
+
+	for (i = 0; i < LOCKSTAT_SITES; i++) {
+		lock_sites[i].nacquired = 0;
+		lock_sites[i].ncontended = 0;
+		lock_sites[i].spin_cycles = 0;
+		lock_sites[i].max_hold = 0;
+	}
+	lock_sites_full = 0;
+}
@@ -0,0 +1,96 @@
+#ifndef JOS_KERN_SPINLOCK_H
+#define JOS_KERN_SPINLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Comment this to disable spinlock debugging
+#define DEBUG_SPINLOCK
+
+// Two kinds of lock.  A spinlock is a ticket lock: waiters take a
+// ticket and are served in order, and while they wait they only read
+// the lock, so its cache line is not bounced by failed atomic writes.
+// An MCS lock queues each waiter on a node of its own, so every waiter
+// spins on a different cache line and a release touches just the next
+// one; it suits locks that many CPUs fight over.
+//
+// Neither lock can be taken by an interrupt handler on a CPU that is
+// already waiting for it, so a lock used by interrupt handlers must be
+// taken with interrupts off.
+
+struct LockSite;
+
+// Mutual exclusion lock.
+struct spinlock {
+	volatile uint32_t next;		// next ticket to hand out
+	volatile uint32_t owner;	// ticket being served
+	char *name;			// Name of lock.
+	struct CpuInfo *cpu;		// The CPU holding the lock.
+	struct LockSite *site;		// lock statistics for this hold
+	uint64_t acquired;		// TSC when acquired, with site
+#ifdef DEBUG_SPINLOCK
+	// For debugging:
+	uintptr_t pcs[10];     // The call stack (an array of program counters)
+	                       // that locked the lock.
+#endif
+};
+
+// A waiter's place in an MCS lock's queue.  The waiter provides the
+// node and must keep it until it has released the lock.
+struct mcsnode {
+	struct mcsnode *volatile next;
+	volatile uint32_t wait;
+};
+
+struct mcslock {
+	struct mcsnode *volatile tail;	// last waiter, NULL if free
+	char *name;
+	struct CpuInfo *cpu;
+	struct LockSite *site;
+	uint64_t acquired;
+};
+
+void __spin_initlock(struct spinlock *lk, char *name);
+void spin_lock(struct spinlock *lk);
+void spin_unlock(struct spinlock *lk);
+bool holding(struct spinlock *lk);
+
+#define spin_initlock(lock)   __spin_initlock(lock, #lock)
+
+void __mcs_initlock(struct mcslock *lk, char *name);
+void mcs_lock(struct mcslock *lk, struct mcsnode *node);
+void mcs_unlock(struct mcslock *lk, struct mcsnode *node);
+bool mcs_holding(struct mcslock *lk);
+
+#define mcs_initlock(lock)    __mcs_initlock(lock, #lock)
+
+// The big kernel lock.  A CPU holds it whenever it runs kernel code,
+// and drops it only to wait with hlt; see trap().  It is an MCS lock,
+// queued on a per-CPU node.
+extern struct mcslock kernel_lock;
+
+void lock_kernel(void);
+void unlock_kernel(void);
+bool kernel_lock_held(void);
+
+// Lock statistics.  While lockstat_enabled is set, every acquisition
+// is counted against its call site and lock: how often, how often it
+// had to wait, the cycles spent waiting and the longest hold.
+struct LockSite {
+	uintptr_t pc;			// call site; 0 if the slot is free
+	const char *name;		// lock name
+	void *lock;
+	uint64_t nacquired;
+	uint64_t ncontended;
+	uint64_t spin_cycles;
+	uint64_t max_hold;		// cycles
+};
+
+extern bool lockstat_enabled;
+
+void lockstat_print(int n);
+void lockstat_clear(void);
+
+#endif	// !JOS_KERN_SPINLOCK_H
@@ -0,0 +1,307 @@
+// Hierarchical timer wheel.
+//
+// Pending timers hang off TIMER_LEVELS levels of TIMER_SLOTS slots.
+// Level 0 has one slot per wheel tick; each slot of level l covers
+// TIMER_SLOTS^l ticks.  A timer goes into the lowest level whose range
+// reaches its expiry, so adding and cancelling one are O(1) list
+// operations.  When the wheel's time crosses the start of a block of
+// level l > 0, the timers in that block's slot are "cascaded": each is
+// moved down to the level that now fits it.
+//
+// There is no periodic tick.  After each pass the wheel works out the
+// next tick at which a slot has work to do -- a level-0 expiry or a
+// cascade -- and arms the LAPIC timer for exactly then, in TSC-deadline
+// mode if the CPU has it.  A CPU that waits with hlt is therefore only
+// interrupted when a timer is due, and with no timers pending it is not
+// interrupted at all.  If the wheel has been idle, its time simply jumps
+// forward to the next tick that has work.
+
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/timer.h>
+#include <kern/kclock.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define NEVER		(~(uint64_t) 0)
+#define LEVEL_SHIFT(l)	((l) * TIMER_SLOTBITS)
+#define WHEEL_RANGE	(1ULL << LEVEL_SHIFT(TIMER_LEVELS))
+
+static struct {
+	struct Timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+	// Bit s is set when slots[l][s] may be non-empty.  Cancelling
+	// a timer leaves its bit set; timer_next clears stale bits.
+	uint64_t occupied[TIMER_LEVELS];
+	uint64_t now;		// next tick to process
+	uint64_t armed;		// tick the LAPIC timer is armed for
+	int armed_cpu;		// and whose LAPIC timer it is
+	uint32_t npending;
+	uint64_t nintr;		// timer interrupts taken
+	uint64_t nfired;	// callbacks run
+	uint64_t ncascaded;	// timers moved down a level
+} wheel = { .armed = NEVER };
+
+static uint64_t
+current_tick(void)
+{
+	return clock_tsc() >> TIMER_SHIFT;
+}
+
+static void
+timer_link(struct Timer **head, struct Timer *t)
+{
+	if ((t->next = *head) != NULL)
+		t->next->pprev = &t->next;
+	*head = t;
+	t->pprev = head;
+}
+
+static void
+timer_unlink(struct Timer *t)
+{
+	if ((*t->pprev = t->next) != NULL)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+// Put t in the slot for t->expires, relative to the wheel's time.
+static void
+timer_insert(struct Timer *t)
+{
+	uint64_t expires = t->expires, delta;
+	int l, slot;
+
+	if (expires < wheel.now)
+		expires = wheel.now;
+	delta = expires - wheel.now;
+	// Timers beyond the wheel's range wait in the farthest slot of
+	// the top level and are re-filed each time it cascades.
+	if (delta >= WHEEL_RANGE)
+		expires = wheel.now + WHEEL_RANGE - 1;
+	for (l = 0; l < TIMER_LEVELS - 1; l++)
+		if (delta < (1ULL << LEVEL_SHIFT(l + 1)))
+			break;
+	slot = (expires >> LEVEL_SHIFT(l)) & (TIMER_SLOTS - 1);
+	timer_link(&wheel.slots[l][slot], t);
+	wheel.occupied[l] |= 1ULL << slot;
+}
+
+// Move slots[l][slot] to a local list, so that its timers can be
+// unlinked one by one (even by a callback) while the slot refills.
+static void
+timer_detach(int l, int slot, struct Timer **list)
+{
+	if ((*list = wheel.slots[l][slot]) != NULL)
+		(*list)->pprev = list;
+	wheel.slots[l][slot] = NULL;
+	wheel.occupied[l] &= ~(1ULL << slot);
+}
+
+// Return the distance, 0 to TIMER_SLOTS-1, from slot 'from' to the
+// first slot at or after it (cyclically) whose bit is set in
+// occupied[l], clearing the bits of empty slots on the way.  Returns
+// -1 if the level is empty.
+static int
+timer_scan(int l, int from)
+{
+	uint64_t map;
+	int k, slot;
+
+	while ((map = wheel.occupied[l]) != 0) {
+		map = (map >> from) | (from ? map << (TIMER_SLOTS - from) : 0);
+		if ((uint32_t) map)
+			k = __builtin_ctz((uint32_t) map);
+		else
+			k = 32 + __builtin_ctz((uint32_t) (map >> 32));
+		slot = (from + k) & (TIMER_SLOTS - 1);
+		if (wheel.slots[l][slot])
+			return k;
+		wheel.occupied[l] &= ~(1ULL << slot);
+	}
+	return -1;
+}
+
+// Return the first tick, at or after wheel.now, at which some slot
+// must be processed, or NEVER.
+static uint64_t
+timer_next(void)
+{
+	uint64_t next = NEVER, block, t;
+	int l, k, idx;
+
+	for (l = 0; l < TIMER_LEVELS; l++) {
+		block = wheel.now >> LEVEL_SHIFT(l);
+		idx = block & (TIMER_SLOTS - 1);
+		if (l == 0 || (wheel.now & ((1ULL << LEVEL_SHIFT(l)) - 1)) == 0) {
+			// The current block has not been processed yet.
+			if ((k = timer_scan(l, idx)) < 0)
+				continue;
+		} else {
+			if ((k = timer_scan(l, (idx + 1) & (TIMER_SLOTS - 1))) < 0)
+				continue;
+			k++;
+		}
+		t = (block + k) << LEVEL_SHIFT(l);
+		if (t < next)
+			next = t;
+	}
+	return next;
+}
+
+// Process tick wheel.now: cascade the upper levels whose blocks start
+// here, then run the timers that expire at this tick.
+static void
+timer_tick(void)
+{
+	uint64_t tick = wheel.now;
+	struct Timer *list, *t;
+	int l, top;
+
+	for (top = 0; top < TIMER_LEVELS - 1; top++)
+		if (tick & ((1ULL << LEVEL_SHIFT(top + 1)) - 1))
+			break;
+	for (l = top; l > 0; l--) {
+		timer_detach(l, (tick >> LEVEL_SHIFT(l)) & (TIMER_SLOTS - 1), &list);
+		while ((t = list) != NULL) {
+			timer_unlink(t);
+			timer_insert(t);
+			wheel.ncascaded++;
+		}
+	}
+
+	timer_detach(0, tick & (TIMER_SLOTS - 1), &list);
+	wheel.now = tick + 1;
+	while ((t = list) != NULL) {
+		timer_unlink(t);
+		wheel.npending--;
+		wheel.nfired++;
+		t->fn(t->arg);
+	}
+}
+
+// Arm the LAPIC timer for the next tick with work, or stop it if there
+// is none.
+static void
+timer_program(void)
+{
+	uint64_t next, now;
+
+	if (!lapic_timer_ok())
+		return;
+	next = timer_next();
+	// Rearm on this CPU, even if another is armed for the same tick:
+	// timer_sleep waits for the interrupt to arrive here.
+	if (next == wheel.armed && wheel.armed_cpu == cpunum())
+		return;
+	wheel.armed = next;
+	wheel.armed_cpu = cpunum();
+	if (next == NEVER) {
+		lapic_timer_stop();
+		return;
+	}
+	now = clock_tsc();
+	lapic_timer_arm((next << TIMER_SHIFT) > now ? (next << TIMER_SHIFT) - now : 1);
+}
+
+// Run every timer that has expired, then re-arm the LAPIC timer.
+void
+timer_run(void)
+{
+	uint64_t target = current_tick(), next;
+
+	while (wheel.now <= target) {
+		next = timer_next();
+		if (next > target) {
+			wheel.now = target + 1;
+			break;
+		}
+		wheel.now = next;
+		timer_tick();
+		// Callbacks take time too.
+		target = current_tick();
+	}
+	timer_program();
+}
+
+// Called from trap_dispatch for the LAPIC timer interrupt.
+void
+timer_intr(void)
+{
+	wheel.nintr++;
+	wheel.armed = NEVER;	// the one-shot has been used up
+	timer_run();
+}
+
+// Arrange for fn(arg) to be called 'ns' nanoseconds from now.  t must
+// not already be pending.
+void
+timer_add(struct Timer *t, uint64_t ns, void (*fn)(void *), void *arg)
+{
+	assert(!timer_pending(t));
+	if (wheel.npending == 0)
+		wheel.now = current_tick();
+	t->expires = (clock_tsc() + clock_ns_to_cycles(ns)) >> TIMER_SHIFT;
+	t->fn = fn;
+	t->arg = arg;
+	timer_insert(t);
+	wheel.npending++;
+	timer_program();
+}
+
+// Stop t from firing.  Returns whether it was pending.
+bool
+timer_cancel(struct Timer *t)
+{
+	if (!timer_pending(t))
+		return 0;
+	timer_unlink(t);
+	wheel.npending--;
+	// The LAPIC may still interrupt for t; timer_run just re-arms it.
+	return 1;
+}
+
+static void
+timer_wake(void *arg)
+{
+	*(volatile bool *) arg = 1;
+}
+
+// Wait for 'ns' nanoseconds.  The CPU halts until the timer interrupt
+// if there is a LAPIC timer; otherwise the wheel is polled.
+void
+timer_sleep(uint64_t ns)
+{
+	struct Timer t = { 0 };
+	volatile bool done = 0;
+	uint32_t eflags = read_eflags();
+	bool locked;
+
+	asm volatile("cli");
+	timer_add(&t, ns, timer_wake, (void *) &done);
+	while (!done) {
+		if (lapic_timer_ok()) {
+			// sti takes effect after the next instruction, so an
+			// interrupt cannot slip in between it and hlt.
+			if ((locked = kernel_lock_held()))
+				unlock_kernel();
+			asm volatile("sti; hlt; cli" ::: "memory");
+			if (locked)
+				lock_kernel();
+		} else {
+			asm volatile("pause");
+			timer_run();
+		}
+	}
+	write_eflags(eflags);
+}
+
+void
+timer_print(void)
+{
+	cprintf("timers: %u pending, %llu fired, %llu cascaded, %llu interrupts%s\n",
+		wheel.npending, wheel.nfired, wheel.ncascaded, wheel.nintr,
+		lapic_timer_ok() ? "" : " (no LAPIC timer: polled)");
+}
@@ -0,0 +1,39 @@
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Kernel timers.  A timer calls fn(arg) once, from the timer interrupt,
+// after a given number of nanoseconds.  The caller owns the struct
+// Timer, which must stay put until the timer fires or is cancelled.
+
+#define TIMER_SHIFT	10	// one wheel tick is 2^TIMER_SHIFT TSC cycles
+#define TIMER_LEVELS	5	// levels in the wheel
+#define TIMER_SLOTBITS	6
+#define TIMER_SLOTS	(1 << TIMER_SLOTBITS)	// slots per level
+
+struct Timer {
+	struct Timer *next;
+	struct Timer **pprev;	// NULL when the timer is not pending
+	uint64_t expires;	// wheel tick at which the timer fires
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+void timer_add(struct Timer *t, uint64_t ns, void (*fn)(void *), void *arg);
+bool timer_cancel(struct Timer *t);
+void timer_intr(void);
+void timer_run(void);
+void timer_sleep(uint64_t ns);
+void timer_print(void);
+
+static inline bool
+timer_pending(const struct Timer *t)
+{
+	return t->pprev != NULL;
+}
+
+#endif	// !JOS_KERN_TIMER_H
@@ -0,0 +1,323 @@
+#include <inc/mmu.h>
+#include <inc/x86.h>
+#include <inc/assert.h>
+#include <inc/memlayout.h>
+
+#include <kern/trap.h>
+#include <kern/console.h>
+#include <kern/monitor.h>
+#include <kern/picirq.h>
+#include <kern/ktrace.h>
+#include <kern/prof.h>
+#include <kern/cpu.h>
+#include <kern/timer.h>
+#include <kern/spinlock.h>
+
+/* Interrupt descriptor table.  (Must be built at run time because
+ * shifted function addresses can't be represented in relocation records.)
+ */
+struct Gatedesc idt[256] = { { 0 } };
+struct Pseudodesc idt_pd = {
+	sizeof(idt) - 1, (uint32_t) idt
+};
+
+// Global descriptor table.
+//
+// Set up global descriptor table (GDT) with separate segments for
+// kernel mode and user mode.  Segments serve many purposes on the x86.
+// We don't use any of their memory-mapping capabilities, but we need
+// them to switch privilege levels.
+//
+// The kernel and user segments are identical except for the DPL.
+// To load the SS register, the CPL must equal the DPL.  Thus,
+// we must duplicate the segments for the user and the kernel.
+//
+// The boot loader's GDT lives in low memory that the kernel does not
+// own, so the kernel installs its own copy as soon as it can.
+struct Segdesc gdt[2 * NCPU + 5] =
+{
+	// 0x0 - unused (always faults -- for trapping NULL far pointers)
+	SEG_NULL,
+
+	// 0x8 - kernel code segment
+	[GD_KT >> 3] = SEG(STA_X | STA_R, 0x0, 0xffffffff, 0),
+
+	// 0x10 - kernel data segment
+	[GD_KD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 0),
+
+	// 0x18 - user code segment
+	[GD_UT >> 3] = SEG(STA_X | STA_R, 0x0, 0xffffffff, 3),
+
+	// 0x20 - user data segment
+	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
+
+	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
+	// in trap_init_percpu()
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// Per-CPU data segments (from GD_PERCPU(0)) are initialized
+	// in percpu_init()
+	[GD_PERCPU(0) >> 3] = SEG_NULL
+};
+
+struct Pseudodesc gdt_pd = {
+	sizeof(gdt) - 1, (unsigned long) gdt
+};
+
+DEFINE_PERCPU(uint64_t, cpu_ntraps);
+DEFINE_PERCPU(uint64_t, cpu_nnmis);
+
+
+static const char *
+trapname(int trapno)
+{
+	static const char * const excnames[] = {
+		"Divide error",
+		"Debug",
+		"Non-Maskable Interrupt",
+		"Breakpoint",
+		"Overflow",
+		"BOUND Range Exceeded",
+		"Invalid Opcode",
+		"Device Not Available",
+		"Double Fault",
+		"Coprocessor Segment Overrun",
+		"Invalid TSS",
+		"Segment Not Present",
+		"Stack Fault",
+		"General Protection",
+		"Page Fault",
+		"(unknown trap)",
+		"x87 FPU Floating-Point Error",
+		"Alignment Check",
+		"Machine-Check",
+		"SIMD Floating-Point Exception"
+	};
+
+	if (trapno < ARRAY_SIZE(excnames))
+		return excnames[trapno];
+	if (trapno == T_SYSCALL)
+		return "System call";
+	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
+		return "Hardware Interrupt";
+	if (trapno == IRQ_OFFSET + IRQ_LTIMER)
+		return "LAPIC Timer";
+	if (trapno == IRQ_OFFSET + IRQ_RESCHED)
+		return "Reschedule IPI";
+	return "(unknown trap)";
+}
+
+
+void
+trap_init(void)
+{
+	extern void t_divide(), t_debug(), t_nmi(), t_brkpt(), t_oflow(),
+		t_bound(), t_illop(), t_device(), t_dblflt(), t_tss(),
+		t_segnp(), t_stack(), t_gpflt(), t_pgflt(), t_fperr(),
+		t_align(), t_mchk(), t_simderr();
+	extern void irq_0(), irq_1(), irq_2(), irq_3(), irq_4(), irq_5(),
+		irq_6(), irq_7(), irq_8(), irq_9(), irq_10(), irq_11(),
+		irq_12(), irq_13(), irq_14(), irq_15();
+	extern void irq_ltimer(), irq_resched();
+	static void (* const irqs[MAX_IRQS])() = {
+		irq_0, irq_1, irq_2, irq_3, irq_4, irq_5, irq_6, irq_7,
+		irq_8, irq_9, irq_10, irq_11, irq_12, irq_13, irq_14, irq_15
+	};
+	int i;
+
+	SETGATE(idt[T_DIVIDE], 0, GD_KT, t_divide, 0);
+	SETGATE(idt[T_DEBUG], 0, GD_KT, t_debug, 0);
+	SETGATE(idt[T_NMI], 0, GD_KT, t_nmi, 0);
+	SETGATE(idt[T_BRKPT], 0, GD_KT, t_brkpt, 3);
+	SETGATE(idt[T_OFLOW], 0, GD_KT, t_oflow, 0);
+	SETGATE(idt[T_BOUND], 0, GD_KT, t_bound, 0);
+	SETGATE(idt[T_ILLOP], 0, GD_KT, t_illop, 0);
+	SETGATE(idt[T_DEVICE], 0, GD_KT, t_device, 0);
+	SETGATE(idt[T_DBLFLT], 0, GD_KT, t_dblflt, 0);
+	SETGATE(idt[T_TSS], 0, GD_KT, t_tss, 0);
+	SETGATE(idt[T_SEGNP], 0, GD_KT, t_segnp, 0);
+	SETGATE(idt[T_STACK], 0, GD_KT, t_stack, 0);
+	SETGATE(idt[T_GPFLT], 0, GD_KT, t_gpflt, 0);
+	SETGATE(idt[T_PGFLT], 0, GD_KT, t_pgflt, 0);
+	SETGATE(idt[T_FPERR], 0, GD_KT, t_fperr, 0);
+	SETGATE(idt[T_ALIGN], 0, GD_KT, t_align, 0);
+	SETGATE(idt[T_MCHK], 0, GD_KT, t_mchk, 0);
+	SETGATE(idt[T_SIMDERR], 0, GD_KT, t_simderr, 0);
+
+	// Hardware interrupts use interrupt gates so that IF is cleared
+	// on entry and handlers are never nested.
+	for (i = 0; i < MAX_IRQS; i++)
+		SETGATE(idt[IRQ_OFFSET + i], 0, GD_KT, irqs[i], 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_LTIMER], 0, GD_KT, irq_ltimer, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_RESCHED], 0, GD_KT, irq_resched, 0);
+
+	// Per-CPU setup
+	trap_init_percpu();
+}
+
+// Initialize and load the per-CPU GDT, TSS and IDT
+void
+trap_init_percpu(void)
+{
+	int i = cpunum();
+
+	// Load the kernel's GDT and reload all segment registers.
+	lgdt(&gdt_pd);
+	// GS addresses this CPU's per-CPU data (see kern/percpu.h).
+	// The kernel never uses FS, so we leave it set to the user
+	// data segment.
+	asm volatile("movw %%ax,%%gs" : : "a" (GD_PERCPU(i)));
+	asm volatile("movw %%ax,%%fs" : : "a" (GD_UD|3));
+	// The kernel does use ES, DS, and SS.  We'll change between
+	// the kernel and user data segments as needed.
+	asm volatile("movw %%ax,%%es" : : "a" (GD_KD));
+	asm volatile("movw %%ax,%%ds" : : "a" (GD_KD));
+	asm volatile("movw %%ax,%%ss" : : "a" (GD_KD));
+	// Load the kernel text segment into CS.
+	asm volatile("ljmp %0,$1f\n 1:\n" : : "i" (GD_KT));
+	// For good measure, clear the local descriptor table (LDT),
+	// since we don't use it.
+	lldt(0);
+
+	// Setup a TSS so that we get the right stack
+	// when we trap to the kernel.
+	cpus[i].cpu_ts.ts_esp0 = KSTACKTOP_CPU(i);
+	cpus[i].cpu_ts.ts_ss0 = GD_KD;
+	cpus[i].cpu_ts.ts_iomb = sizeof(struct Taskstate);
+
+	// Initialize this CPU's TSS slot of the gdt.
+	gdt[(GD_TSS0 >> 3) + i] = SEG16(STS_T32A, (uint32_t) (&cpus[i].cpu_ts),
+					sizeof(struct Taskstate) - 1, 0);
+	gdt[(GD_TSS0 >> 3) + i].sd_s = 0;
+
+	// Load the TSS selector (like other segment selectors, the
+	// bottom three bits are special; we leave them 0)
+	ltr(GD_TSS0 + (i << 3));
+
+	// Load the IDT
+	lidt(&idt_pd);
+}
+
+void
+print_trapframe(struct Trapframe *tf)
+{
+	cprintf("TRAP frame at %p\n", tf);
+	print_regs(&tf->tf_regs);
+	cprintf("  es   0x----%04x\n", tf->tf_es);
+	cprintf("  ds   0x----%04x\n", tf->tf_ds);
+	cprintf("  trap 0x%08x %s\n", tf->tf_trapno, trapname(tf->tf_trapno));
+	// If this trap was a page fault, print the faulting address
+	if (tf->tf_trapno == T_PGFLT)
+		cprintf("  cr2  0x%08x\n", rcr2());
+	cprintf("  err  0x%08x\n", tf->tf_err);
+	cprintf("  eip  0x%08x\n", tf->tf_eip);
+	cprintf("  cs   0x----%04x\n", tf->tf_cs);
+	cprintf("  flag 0x%08x\n", tf->tf_eflags);
+	if ((tf->tf_cs & 3) != 0) {
+		cprintf("  esp  0x%08x\n", tf->tf_esp);
+		cprintf("  ss   0x----%04x\n", tf->tf_ss);
+	}
+}
+
+void
+print_regs(struct PushRegs *regs)
+{
+	cprintf("  edi  0x%08x\n", regs->reg_edi);
+	cprintf("  esi  0x%08x\n", regs->reg_esi);
+	cprintf("  ebp  0x%08x\n", regs->reg_ebp);
+	cprintf("  oesp 0x%08x\n", regs->reg_oesp);
+	cprintf("  ebx  0x%08x\n", regs->reg_ebx);
+	cprintf("  edx  0x%08x\n", regs->reg_edx);
+	cprintf("  ecx  0x%08x\n", regs->reg_ecx);
+	cprintf("  eax  0x%08x\n", regs->reg_eax);
+}
+
+static void
+trap_dispatch(struct Trapframe *tf)
+{
+	switch (tf->tf_trapno) {
+	// While profiling, PIT ticks arrive as NMIs (see trap()); one
+	// left pending from before 'prof stop' can still come this way.
+	case IRQ_OFFSET + IRQ_TIMER:
+		return;
+
+	case IRQ_OFFSET + IRQ_LTIMER:
+		lapic_eoi();
+		timer_intr();
+		return;
+
+	case IRQ_OFFSET + IRQ_KBD:
+		kbd_intr();
+		return;
+
+	case IRQ_OFFSET + IRQ_SERIAL:
+		serial_intr();
+		return;
+
+	// Handle spurious interrupts
+	// The hardware sometimes raises these because of noise on the
+	// IRQ line or other reasons. We don't care.
+	case IRQ_OFFSET + IRQ_SPURIOUS:
+		cprintf("Spurious interrupt on irq 7\n");
+		print_trapframe(tf);
+		return;
+	}
+
+	// Unexpected trap: there is no user mode yet, so it must have
+	// come from the kernel.
+	print_trapframe(tf);
+	panic("unhandled trap in kernel");
+}
+
+void
+trap(struct Trapframe *tf)
+{
+	bool locked;
+
+	// The environment may have set DF and some versions
+	// of GCC rely on DF being clear
+	asm volatile("cld" ::: "cc");
+
+	// Check that interrupts are disabled.  If this assertion
+	// fails, DO NOT be tempted to fix it by inserting a "cli" in
+	// the interrupt path.
+	assert(!(read_eflags() & FL_IF));
+
+	// An NMI can interrupt code that holds any lock, even this
+	// CPU's place in the kernel lock's queue, so it is handled
+	// before anything else and touches nothing shared.  NMIs are
+	// profiler samples; one that arrives while the profiler is off
+	// (late, or from the hardware) is only counted.
+	if (tf->tf_trapno == T_NMI) {
+		this_cpu_inc(cpu_nnmis);
+		prof_tick(tf);
+		return;
+	}
+
+	// Nothing to do but acknowledge: the interrupt has already woken
+	// the CPU from hlt, and its idle loop will look at the run queues
+	// (tasks run without the big kernel lock).  Taking the lock here
+	// would make the wakeup wait for whoever holds it.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED) {
+		this_cpu_inc(cpu_ntraps);
+		lapic_eoi();
+		return;
+	}
+
+	// A CPU that was waiting with hlt does not hold the big kernel
+	// lock; take it for as long as the handler runs.
+	if ((locked = !kernel_lock_held()))
+		lock_kernel();
+
+	this_cpu_inc(cpu_ntraps);
+	KTRACE("trap %u eip %08x", tf->tf_trapno, tf->tf_eip);
+	trap_dispatch(tf);
+
+	// Spurious interrupts must not be acknowledged.
+	if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS
+	    && tf->tf_trapno != IRQ_OFFSET + IRQ_SPURIOUS)
+		irq_eoi(tf->tf_trapno - IRQ_OFFSET);
+
+	if (locked)
+		unlock_kernel();
+}
@@ -0,0 +1,26 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TRAP_H
+#define JOS_KERN_TRAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/trap.h>
+#include <inc/mmu.h>
+#include <kern/percpu.h>
+
+/* The kernel's interrupt descriptor table */
+extern struct Gatedesc idt[];
+extern struct Pseudodesc idt_pd;
+
+/* Traps and interrupts handled by each CPU, and NMIs among them */
+DECLARE_PERCPU(uint64_t, cpu_ntraps);
+DECLARE_PERCPU(uint64_t, cpu_nnmis);
+
+void trap_init(void);
+void trap_init_percpu(void);
+void print_regs(struct PushRegs *regs);
+void print_trapframe(struct Trapframe *tf);
+
+#endif /* JOS_KERN_TRAP_H */
@@ -10,7 +10,7 @@
 
 /*
  * Space or zero padding and a field width are supported for the numeric
- * formats only.
+ * formats and %s.
  *
  * The special format %e takes an integer error code
  * and prints a string describing the error.
@@ -28,25 +28,152 @@ static const char * const error_string[MAXERROR] =
 	[E_FAULT]	= "segmentation fault",
 };
 
+// Output 'count' copies of the character 'c'.
+static void
+printpad(void (*putn)(const char *, size_t, void *), void *putdat,
+	 int c, int count)
+{
+	static const char spaces[16] = "                ";
+	static const char zeros[16] = "0000000000000000";
+	const char *run;
+	char buf[16];
+	int n;
+
+	if (c == ' ')
+		run = spaces;
+	else if (c == '0')
+		run = zeros;
+	else {
+		memset(buf, c, sizeof(buf));
+		run = buf;
+	}
+	for (; count > 0; count -= n) {
+		n = MIN(count, 16);
+		putn(run, n, putdat);
+	}
+}
+
+// Digit-conversion kernels.  Each fills a buffer backwards from 'end'
+// and returns a pointer to the first digit.  None of them divides a
+// 64-bit value in C, which on i386 would call libgcc's __udivdi3 and
+// __umoddi3 once per digit: octal and hex use shifts and masks, and
+// decimal works 32 bits at a time, where the compiler turns division
+// by a constant into a multiply, two digits per step.
+
+static const char digits[] = "0123456789abcdef";
+
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+// Convert using 'shift' bits per digit (3 for octal, 4 for hex).
+static char *
+fmt_pow2(char *end, unsigned long long num, int shift)
+{
+	uint32_t mask = (1 << shift) - 1, v;
+
+	// Do the high bits with 64-bit shifts only while they matter.
+	while (num >> 32) {
+		*--end = digits[(uint32_t) num & mask];
+		num >>= shift;
+	}
+	v = num;
+	do {
+		*--end = digits[v & mask];
+		v >>= shift;
+	} while (v != 0);
+	return end;
+}
+
+// Convert a 32-bit value to decimal, two digits at a time.
+static char *
+fmt_dec32(char *end, uint32_t v)
+{
+	const char *d;
+	uint32_t q;
+
+	while (v >= 100) {
+		q = v / 100;
+		d = &digit_pairs[2 * (v - q * 100)];
+		*--end = d[1];
+		*--end = d[0];
+		v = q;
+	}
+	if (v >= 10) {
+		d = &digit_pairs[2 * v];
+		*--end = d[1];
+		*--end = d[0];
+	} else
+		*--end = '0' + v;
+	return end;
+}
+
+// Divide *n by d in place and return the remainder, using two 32-bit
+// divides: the remainder of the high word is always less than d,
+// so the second divl cannot overflow.
+static uint32_t
+div64_32(unsigned long long *n, uint32_t d)
+{
+	uint32_t hi = *n >> 32, lo = *n, rem;
+
+	rem = hi % d;
+	hi /= d;
+	asm("divl %2" : "+a" (lo), "+d" (rem) : "rm" (d) : "cc");
+	*n = ((unsigned long long) hi << 32) | lo;
+	return rem;
+}
+
+static char *
+fmt_dec(char *end, unsigned long long num)
+{
+	char *p;
+
+	// Peel off nine digits at a time until the rest fits in 32 bits.
+	while (num >> 32) {
+		p = fmt_dec32(end, div64_32(&num, 1000000000));
+		while (p > end - 9)
+			*--p = '0';
+		end = p;
+	}
+	return fmt_dec32(end, num);
+}
+
 /*
- * Print a number (base <= 16) in reverse order,
- * using specified putch function and associated pointer putdat.
+ * Print a number (base 8, 10 or 16),
+ * using specified putn function and associated pointer putdat.
+ * The digits are converted into a buffer first and output in one run.
  */
 static void
-printnum(void (*putch)(int, void*), void *putdat,
+printnum(void (*putn)(const char *, size_t, void *), void *putdat,
 	 unsigned long long num, unsigned base, int width, int padc)
 {
-	// first recursively print all preceding (more significant) digits
-	if (num >= base) {
-		printnum(putch, putdat, num / base, base, width - 1, padc);
-	} else {
-		// print any needed pad characters before first digit
-		while (--width > 0)
-			putch(padc, putdat);
-	}
-
-	// then print this (the least significant) digit
-	putch("0123456789abcdef"[num % base], putdat);
+	char buf[24];		// enough for 64 bits in octal
+	char *p;
+	int n;
+
+	if (base == 16)
+		p = fmt_pow2(buf + sizeof(buf), num, 4);
+	else if (base == 8)
+		p = fmt_pow2(buf + sizeof(buf), num, 3);
+	else
+		p = fmt_dec(buf + sizeof(buf), num);
+	n = buf + sizeof(buf) - p;
+
+	// print any needed pad characters before first digit
+	if (padc != '-' && width > n)
+		printpad(putn, putdat, padc, width - n);
+	putn(p, n, putdat);
+	// or after the last, when left-justifying
+	if (padc == '-' && width > n)
+		printpad(putn, putdat, ' ', width - n);
 }
 
 // Get an unsigned int of various possible sizes from a varargs list,
@@ -77,22 +204,33 @@ getint(va_list *ap, int lflag)
 
 
 // Main function to format and print a string.
-void printfmt(void (*putch)(int, void*), void *putdat, const char *fmt, ...);
+// Output is handed to 'putn' in runs: literal text between
+// conversions, padding, and each converted field as a whole.
+void printfmt_n(void (*putn)(const char *, size_t, void *), void *putdat, const char *fmt, ...);
 
 void
-vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
+vprintfmt_n(void (*putn)(const char *, size_t, void *), void *putdat,
+	    const char *fmt, va_list aparg)
 {
-	register const char *p;
+	register const char *p, *q, *e;
 	register int ch, err;
 	unsigned long long num;
-	int base, lflag, width, precision, altflag;
-	char padc;
+	int base, lflag, width, precision, altflag, len;
+	char padc, c;
+	va_list ap;
 
+	// getint and getuint take a va_list *.  Where va_list is an array
+	// type (as on x86-64, when lib/ is built for the host), the address
+	// of a va_list parameter is not one, so work on a local copy.
+	va_copy(ap, aparg);
 	while (1) {
-		while ((ch = *(unsigned char *) fmt++) != '%') {
-			if (ch == '\0')
-				return;
-			putch(ch, putdat);
+		for (p = fmt; *fmt != '%' && *fmt != '\0'; fmt++)
+			/* do nothing */;
+		if (fmt > p)
+			putn(p, fmt - p, putdat);
+		if (*fmt++ == '\0') {
+			va_end(ap);
+			return;
 		}
 
 		// Process a %-escape sequence
@@ -157,7 +295,8 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 
 		// character
 		case 'c':
-			putch(va_arg(ap, int), putdat);
+			c = va_arg(ap, int);
+			putn(&c, 1, putdat);
 			break;
 
 		// error message
@@ -166,32 +305,41 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 			if (err < 0)
 				err = -err;
 			if (err >= MAXERROR || (p = error_string[err]) == NULL)
-				printfmt(putch, putdat, "error %d", err);
+				printfmt_n(putn, putdat, "error %d", err);
 			else
-				printfmt(putch, putdat, "%s", p);
+				printfmt_n(putn, putdat, "%s", p);
 			break;
 
 		// string
 		case 's':
 			if ((p = va_arg(ap, char *)) == NULL)
 				p = "(null)";
-			if (width > 0 && padc != '-')
-				for (width -= strnlen(p, precision); width > 0; width--)
-					putch(padc, putdat);
-			for (; (ch = *p++) != '\0' && (precision < 0 || --precision >= 0); width--)
-				if (altflag && (ch < ' ' || ch > '~'))
-					putch('?', putdat);
-				else
-					putch(ch, putdat);
-			for (; width > 0; width--)
-				putch(' ', putdat);
+			len = strnlen(p, precision);
+			if (width > len && padc != '-')
+				printpad(putn, putdat, padc, width - len);
+			if (!altflag)
+				putn(p, len, putdat);
+			else
+				// replace unprintable characters with '?'
+				for (e = p + len; p < e; p = q) {
+					for (q = p; q < e && *q >= ' ' && *q <= '~'; q++)
+						/* do nothing */;
+					if (q > p)
+						putn(p, q - p, putdat);
+					if (q < e) {
+						putn("?", 1, putdat);
+						q++;
+					}
+				}
+			if (width > len && padc == '-')
+				printpad(putn, putdat, ' ', width - len);
 			break;
 
 		// (signed) decimal
 		case 'd':
 			num = getint(&ap, lflag);
 			if ((long long) num < 0) {
-				putch('-', putdat);
+				putn("-", 1, putdat);
 				num = -(long long) num;
 			}
 			base = 10;
@@ -205,16 +353,13 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 
 		// (unsigned) octal
 		case 'o':
-			// Replace this with your code.
-			putch('X', putdat);
-			putch('X', putdat);
-			putch('X', putdat);
-			break;
+			num = getuint(&ap, lflag);
+			base = 8;
+			goto number;
 
 		// pointer
 		case 'p':
-			putch('0', putdat);
-			putch('x', putdat);
+			putn("0x", 2, putdat);
 			num = (unsigned long long)
 				(uintptr_t) va_arg(ap, void *);
 			base = 16;
@@ -225,17 +370,17 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 			num = getuint(&ap, lflag);
 			base = 16;
 		number:
-			printnum(putch, putdat, num, base, width, padc);
+			printnum(putn, putdat, num, base, width, padc);
 			break;
 
 		// escaped '%' character
 		case '%':
-			putch(ch, putdat);
+			putn("%", 1, putdat);
 			break;
 
 		// unrecognized escape sequence - just print it literally
 		default:
-			putch('%', putdat);
+			putn("%", 1, putdat);
 			for (fmt--; fmt[-1] != '%'; fmt--)
 				/* do nothing */;
 			break;
@@ -243,6 +388,37 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 	}
 }
 
+void
+printfmt_n(void (*putn)(const char *, size_t, void *), void *putdat, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintfmt_n(putn, putdat, fmt, ap);
+	va_end(ap);
+}
+
+// Adapter that feeds runs from vprintfmt_n to a per-character putch.
+struct putchbuf {
+	void (*putch)(int, void*);
+	void *putdat;
+};
+
+static void
+putch_n(const char *s, size_t n, struct putchbuf *b)
+{
+	while (n-- > 0)
+		b->putch(*s++, b->putdat);
+}
+
+void
+vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
+{
+	struct putchbuf b = { putch, putdat };
+
+	vprintfmt_n((void*)putch_n, &b, fmt, ap);
+}
+
 void
 printfmt(void (*putch)(int, void*), void *putdat, const char *fmt, ...)
 {
@@ -260,11 +436,13 @@ struct sprintbuf {
 };
 
 static void
-sprintputch(int ch, struct sprintbuf *b)
+sprintputn(const char *s, size_t n, struct sprintbuf *b)
 {
-	b->cnt++;
-	if (b->buf < b->ebuf)
-		*b->buf++ = ch;
+	b->cnt += n;
+	if (n > b->ebuf - b->buf)
+		n = b->ebuf - b->buf;
+	memcpy(b->buf, s, n);
+	b->buf += n;
 }
 
 int
@@ -276,7 +454,7 @@ vsnprintf(char *buf, int n, const char *fmt, va_list ap)
 		return -E_INVAL;
 
 	// print the string to the buffer
-	vprintfmt((void*)sprintputch, &b, fmt, ap);
+	vprintfmt_n((void*)sprintputn, &b, fmt, ap);
 
 	// null terminate the buffer
 	*b.buf = '\0';
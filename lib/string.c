@@ -1,6 +1,7 @@
 // Basic string routines.  Not hardware optimized, but not shabby.
 
 #include <inc/string.h>
+#include <inc/mmu.h>
 
 // Using assembly for memset/memmove
 // makes some difference on real hardware,
@@ -8,24 +9,119 @@
 // Primespipe runs 3x faster this way.
 #define ASM 1
 
+// Word-at-a-time scanning.  Loads are always aligned to their own size,
+// so a load that touches the first byte of interest never crosses into
+// the next page and cannot fault even when it reads past the string.
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+#define ONES		0x01010101U
+#define HIGHS		0x80808080U
+// Nonzero if some byte of 'x' is zero.  The lowest set bit always marks
+// the first zero byte; bits above it may be false positives.
+#define HASZERO(x)	(((x) - ONES) & ~(x) & HIGHS)
+// Index of the byte marked by the lowest set bit of a match mask.
+#define FIRSTBYTE(m)	(__builtin_ctz(m) >> 3)
+
+// No limit on the number of bytes a string scan may examine.
+#define NOLIMIT		((size_t) -1)
+
+// Return a pointer to the first of the 'n' bytes at 's' that equals 'c'
+// or, if 'nul' is set, is zero; or s + n if there is none.
+static const char *
+scan_swar(const char *s, int c, size_t n, bool nul)
+{
+	const char *p;
+	uint32_t cw, w, m;
+
+	c = (uint8_t) c;
+	for (; n > 0 && ((uintptr_t) s & 3); s++, n--)
+		if ((uint8_t) *s == c || (nul && *s == '\0'))
+			return s;
+	if (n == 0)
+		return s;
+
+	if (c == 0)
+		nul = 0;	// the match on 'c' already finds it
+	cw = c * ONES;
+	for (p = s; ; p += 4, n -= 4) {
+		w = *(const word_t *) p;
+		m = HASZERO(w ^ cw);
+		if (nul)
+			m |= HASZERO(w);
+		if (m)
+			return p + MIN((size_t) FIRSTBYTE(m), n);
+		if (n <= 4)
+			return p + n;
+	}
+}
+
+// The same with SSE2, 16 bytes at a time.  The first block is the
+// aligned one containing 's'; matches before 's' are masked off.
+typedef char v16qi __attribute__((vector_size(16)));
+
+__attribute__((target("sse2")))
+static const char *
+scan_sse2(const char *s, int c, size_t n, bool nul)
+{
+	const v16qi *p;
+	v16qi cv, nv, zero = { 0 }, x;
+	uint32_t m;
+
+	if (n == 0)
+		return s;
+	cv = zero + (char) c;
+	nv = zero - (char) nul;		// all ones if scanning for a nul
+	p = (const v16qi *) ((uintptr_t) s & ~15);
+	x = *p;
+	m = __builtin_ia32_pmovmskb128((x == cv) | ((x == zero) & nv));
+	m &= 0xFFFF << ((uintptr_t) s & 15);
+	for (;;) {
+		if (m) {
+			const char *r = (const char *) p + __builtin_ctz(m);
+			return (size_t) (r - s) < n ? r : s + n;
+		}
+		if ((size_t) ((const char *) ++p - s) >= n)
+			return s + n;
+		x = *p;
+		m = __builtin_ia32_pmovmskb128((x == cv) | ((x == zero) & nv));
+	}
+}
+
+static const struct {
+	const char *name;
+	const char *(*scan)(const char *s, int c, size_t n, bool nul);
+} scanners[] = {
+	[STRSCAN_SWAR] = { "swar", scan_swar },
+	[STRSCAN_SSE2] = { "sse2", scan_sse2 },
+};
+
+static int scanner = STRSCAN_SWAR;
+
+// Select the implementation used by the string scanning functions.
+// As with string_set_variant, the caller checks CPU support.
+void
+string_set_scan(int v)
+{
+	if (v >= 0 && v < ARRAY_SIZE(scanners))
+		scanner = v;
+}
+
+const char *
+string_scan_name(void)
+{
+	return scanners[scanner].name;
+}
+
 int
 strlen(const char *s)
 {
-	int n;
-
-	for (n = 0; *s != '\0'; s++)
-		n++;
-	return n;
+	return scanners[scanner].scan(s, 0, NOLIMIT, 1) - s;
 }
 
 int
 strnlen(const char *s, size_t size)
 {
-	int n;
-
-	for (n = 0; size > 0 && *s != '\0'; s++, size--)
-		n++;
-	return n;
+	return scanners[scanner].scan(s, 0, size, 1) - s;
 }
 
 char *
@@ -79,6 +175,26 @@ strlcpy(char *dst, const char *src, size_t size)
 int
 strcmp(const char *p, const char *q)
 {
+	uint32_t a, i;
+
+	// Compare a word at a time once p is aligned.  q may not be, so
+	// step over the bytes one at a time where q's word would straddle
+	// a page boundary.
+	for (; (uintptr_t) p & 3; p++, q++)
+		if (*p == '\0' || *p != *q)
+			goto bytes;
+	for (;;) {
+		if (PGOFF(q) <= PGSIZE - 4) {
+			a = *(const word_t *) p;
+			if (a != *(const word_t *) q || HASZERO(a))
+				break;
+			p += 4, q += 4;
+		} else
+			for (i = 0; i < 4; i++, p++, q++)
+				if (*p == '\0' || *p != *q)
+					goto bytes;
+	}
+bytes:
 	while (*p && *p == *q)
 		p++, q++;
 	return (int) ((unsigned char) *p - (unsigned char) *q);
@@ -100,10 +216,8 @@ strncmp(const char *p, const char *q, size_t n)
 char *
 strchr(const char *s, char c)
 {
-	for (; *s; s++)
-		if (*s == c)
-			return (char *) s;
-	return 0;
+	s = scanners[scanner].scan(s, c, NOLIMIT, 1);
+	return *s ? (char *) s : 0;
 }
 
 // Return a pointer to the first occurrence of 'c' in 's',
@@ -111,31 +225,224 @@ strchr(const char *s, char c)
 char *
 strfind(const char *s, char c)
 {
-	for (; *s; s++)
-		if (*s == c)
-			break;
-	return (char *) s;
+	return (char *) scanners[scanner].scan(s, c, NOLIMIT, 1);
 }
 
 #if ASM
+
+// Copies and fills shorter than this are done inline with rep string
+// instructions; longer ones go through the variant selected with
+// string_set_variant.
+#define BULK_MIN	256
+
+// Copy forward: single bytes up to a 4-byte boundary of the
+// destination, then whole words, then the remaining bytes.
+// Short copies go straight to the byte loop.
+static inline void
+copy_fwd(char *d, const char *s, size_t n)
+{
+	size_t head, words;
+
+	head = n < 16 ? n : -(uintptr_t) d & 3;
+	n -= head;
+	words = n / 4;
+	n %= 4;
+	asm volatile("cld; rep movsb\n"
+		: "+D" (d), "+S" (s), "+c" (head) : : "cc", "memory");
+	asm volatile("rep movsl\n"
+		: "+D" (d), "+S" (s), "+c" (words) : : "memory");
+	asm volatile("rep movsb\n"
+		: "+D" (d), "+S" (s), "+c" (n) : : "memory");
+}
+
+// Copy backward, for overlapping moves to a higher address: the same
+// three steps, starting from the end with the direction flag set.
+static inline void
+copy_bwd(char *d, const char *s, size_t n)
+{
+	size_t tail, words;
+
+	d += n - 1;
+	s += n - 1;
+	tail = n < 16 ? n : (uintptr_t) (d + 1) & 3;
+	n -= tail;
+	words = n / 4;
+	n %= 4;
+	asm volatile("std; rep movsb\n"
+		: "+D" (d), "+S" (s), "+c" (tail) : : "cc", "memory");
+	// movsl addresses the lowest byte of each word
+	d -= 3;
+	s -= 3;
+	asm volatile("rep movsl\n"
+		: "+D" (d), "+S" (s), "+c" (words) : : "memory");
+	d += 3;
+	s += 3;
+	asm volatile("rep movsb\n"
+		: "+D" (d), "+S" (s), "+c" (n) : : "memory");
+	// Some versions of GCC rely on DF being clear
+	asm volatile("cld" ::: "cc");
+}
+
+// Fill like copy_fwd: bytes, aligned words, bytes.
+static inline void
+fill_fwd(char *p, int c, size_t n)
+{
+	size_t head, words;
+
+	c &= 0xFF;
+	c = (c<<24)|(c<<16)|(c<<8)|c;
+	head = n < 16 ? n : -(uintptr_t) p & 3;
+	n -= head;
+	words = n / 4;
+	n %= 4;
+	asm volatile("cld; rep stosb\n"
+		: "+D" (p), "+c" (head) : "a" (c) : "cc", "memory");
+	asm volatile("rep stosl\n"
+		: "+D" (p), "+c" (words) : "a" (c) : "memory");
+	asm volatile("rep stosb\n"
+		: "+D" (p), "+c" (n) : "a" (c) : "memory");
+}
+
+static void *
+memcpy_rep(void *dst, const void *src, size_t n)
+{
+	copy_fwd(dst, src, n);
+	return dst;
+}
+
+static void *
+memset_rep(void *v, int c, size_t n)
+{
+	fill_fwd(v, c, n);
+	return v;
+}
+
+// On CPUs with Enhanced REP MOVSB/STOSB, a single byte-granular rep
+// instruction is the fastest way to move large blocks.
+static void *
+memcpy_erms(void *dst, const void *src, size_t n)
+{
+	char *d = dst;
+
+	asm volatile("cld; rep movsb\n"
+		: "+D" (d), "+S" (src), "+c" (n) : : "cc", "memory");
+	return dst;
+}
+
+static void *
+memset_erms(void *v, int c, size_t n)
+{
+	char *p = v;
+
+	asm volatile("cld; rep stosb\n"
+		: "+D" (p), "+c" (n) : "a" (c) : "cc", "memory");
+	return v;
+}
+
+// SSE2: align the destination to 16 bytes, then move 64 bytes per
+// iteration through four XMM registers.
+__attribute__((target("sse2")))
+static void *
+memcpy_sse2(void *dst, const void *src, size_t n)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t head;
+
+	head = -(uintptr_t) d & 15;
+	copy_fwd(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+	for (; n >= 64; n -= 64, d += 64, s += 64)
+		asm volatile("movdqu (%1), %%xmm0\n"
+			     "movdqu 16(%1), %%xmm1\n"
+			     "movdqu 32(%1), %%xmm2\n"
+			     "movdqu 48(%1), %%xmm3\n"
+			     "movdqa %%xmm0, (%0)\n"
+			     "movdqa %%xmm1, 16(%0)\n"
+			     "movdqa %%xmm2, 32(%0)\n"
+			     "movdqa %%xmm3, 48(%0)\n"
+			     : : "r" (d), "r" (s)
+			     : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+	copy_fwd(d, s, n);
+	return dst;
+}
+
+__attribute__((target("sse2")))
+static void *
+memset_sse2(void *v, int c, size_t n)
+{
+	char *p = v;
+	size_t head, blocks;
+
+	head = -(uintptr_t) p & 15;
+	fill_fwd(p, c, head);
+	p += head;
+	n -= head;
+	blocks = n / 64;
+	n %= 64;
+	c &= 0xFF;
+	c = (c<<24)|(c<<16)|(c<<8)|c;
+	if (blocks > 0)
+		asm volatile("movd %2, %%xmm0\n"
+			     "pshufd $0, %%xmm0, %%xmm0\n"
+			     "1:\n"
+			     "movdqa %%xmm0, (%0)\n"
+			     "movdqa %%xmm0, 16(%0)\n"
+			     "movdqa %%xmm0, 32(%0)\n"
+			     "movdqa %%xmm0, 48(%0)\n"
+			     "add $64, %0\n"
+			     "dec %1\n"
+			     "jnz 1b\n"
+			     : "+r" (p), "+r" (blocks) : "r" (c)
+			     : "xmm0", "cc", "memory");
+	fill_fwd(p, c, n);
+	return v;
+}
+
+static const struct {
+	const char *name;
+	void *(*memcpy)(void *dst, const void *src, size_t n);
+	void *(*memset)(void *v, int c, size_t n);
+} variants[] = {
+	[STRING_REP] = { "rep", memcpy_rep, memset_rep },
+	[STRING_ERMS] = { "erms", memcpy_erms, memset_erms },
+	[STRING_SSE2] = { "sse2", memcpy_sse2, memset_sse2 },
+	[STRING_FSRM] = { "fsrm", memcpy_erms, memset_erms },
+};
+
+static int variant = STRING_REP;
+// Copies at least this long go through the variant.  With fast short
+// REP MOVSB, a single rep movsb beats the inline path at any size.
+static size_t copy_min = BULK_MIN;
+
+// Select the implementation used for large copies and fills.
+// The caller must check that the CPU (and, for SSE2, the operating
+// system's CR4 setup) supports it.
+void
+string_set_variant(int v)
+{
+	if (v >= 0 && v < ARRAY_SIZE(variants)) {
+		variant = v;
+		copy_min = (v == STRING_FSRM ? 0 : BULK_MIN);
+	}
+}
+
+const char *
+string_variant_name(void)
+{
+	return variants[variant].name;
+}
+
 void *
 memset(void *v, int c, size_t n)
 {
-	char *p;
-
-	if (n == 0)
+	if (n < BULK_MIN) {
+		fill_fwd(v, c, n);
 		return v;
-	if ((int)v%4 == 0 && n%4 == 0) {
-		c &= 0xFF;
-		c = (c<<24)|(c<<16)|(c<<8)|c;
-		asm volatile("cld; rep stosl\n"
-			:: "D" (v), "a" (c), "c" (n/4)
-			: "cc", "memory");
-	} else
-		asm volatile("cld; rep stosb\n"
-			:: "D" (v), "a" (c), "c" (n)
-			: "cc", "memory");
-	return v;
+	}
+	return variants[variant].memset(v, c, n);
 }
 
 void *
@@ -147,25 +454,21 @@ memmove(void *dst, const void *src, size_t n)
 	s = src;
 	d = dst;
 	if (s < d && s + n > d) {
-		s += n;
-		d += n;
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("std; rep movsl\n"
-				:: "D" (d-4), "S" (s-4), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("std; rep movsb\n"
-				:: "D" (d-1), "S" (s-1), "c" (n) : "cc", "memory");
-		// Some versions of GCC rely on DF being clear
-		asm volatile("cld" ::: "cc");
-	} else {
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("cld; rep movsl\n"
-				:: "D" (d), "S" (s), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("cld; rep movsb\n"
-				:: "D" (d), "S" (s), "c" (n) : "cc", "memory");
+		copy_bwd(d, s, n);
+		return dst;
 	}
-	return dst;
+	return memcpy(dst, src, n);
+}
+
+// Unlike memmove, memcpy never checks for overlap.
+void *
+memcpy(void *dst, const void *src, size_t n)
+{
+	if (n < copy_min) {
+		copy_fwd(dst, src, n);
+		return dst;
+	}
+	return variants[variant].memcpy(dst, src, n);
 }
 
 #else
@@ -203,7 +506,6 @@ memmove(void *dst, const void *src, size_t n)
 
 	return dst;
 }
-#endif
 
 void *
 memcpy(void *dst, const void *src, size_t n)
@@ -211,6 +513,18 @@ memcpy(void *dst, const void *src, size_t n)
 	return memmove(dst, src, n);
 }
 
+void
+string_set_variant(int v)
+{
+}
+
+const char *
+string_variant_name(void)
+{
+	return "c";
+}
+#endif
+
 int
 memcmp(const void *v1, const void *v2, size_t n)
 {
@@ -229,11 +543,7 @@ memcmp(const void *v1, const void *v2, size_t n)
 void *
 memfind(const void *s, int c, size_t n)
 {
-	const void *ends = (const char *) s + n;
-	for (; s < ends; s++)
-		if (*(const unsigned char *) s == (unsigned char) c)
-			break;
-	return (void *) s;
+	return (void *) scanners[scanner].scan(s, c, n, 0);
 }
 
 long